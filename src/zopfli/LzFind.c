@@ -7,6 +7,7 @@
 
 #include "LzFind.h"
 #include "util.h"
+#include "cpu.h"
 #include "match.h"
 
 void MatchFinder_Free(CMatchFinder *p)
@@ -14,17 +15,29 @@ void MatchFinder_Free(CMatchFinder *p)
   free(p->hash);
 }
 
-void MatchFinder_Create(CMatchFinder *p)
+unsigned MatchFinder_HashLog(size_t size)
 {
-  //256kb hash, 256kb binary tree
-  p->hash = (UInt32*)malloc(((2 * ZOPFLI_WINDOW_SIZE) + LZFIND_HASH_SIZE) * sizeof(UInt32));
+  //Larger inputs have more distinct trigrams in the window; with fewer collisions the trees are shallower.
+  //Small inputs don't gain from it and keep the allocation small.
+  unsigned hashLog = size ? floor_log2_sz(size) - 2 : 0;
+  if (hashLog < LZFIND_HASH_LOG_MIN) hashLog = LZFIND_HASH_LOG_MIN;
+  if (hashLog > LZFIND_HASH_LOG_MAX) hashLog = LZFIND_HASH_LOG_MAX;
+  return hashLog;
+}
+
+void MatchFinder_Create(CMatchFinder *p, unsigned hashLog)
+{
+  UInt32 hashSize = (UInt32)1 << hashLog;
+  //Up to 1mb hash, 256kb binary tree
+  p->hash = (UInt32*)malloc(((2 * ZOPFLI_WINDOW_SIZE) + hashSize) * sizeof(UInt32));
   if (!p->hash)
   {
     exit(1);
   }
-  p->son = p->hash + LZFIND_HASH_SIZE;
+  p->son = p->hash + hashSize;
+  p->hashMask = hashSize - 1;
 
-  memset(p->hash, 0, LZFIND_HASH_SIZE * sizeof(unsigned));
+  memset(p->hash, 0, hashSize * sizeof(unsigned));
   p->cyclicBufferPos = 0;
   p->pos = ZOPFLI_WINDOW_SIZE;
 }
@@ -312,17 +325,21 @@ static void SkipMatches2(UInt32 *son, UInt32 _cyclicBufferPos)
   *ptr0 = pair[1];
 }
 
-#ifdef ZOPFLI_HAVE_SSE4_2
-#include <nmmintrin.h>
-#define HASH(cur) unsigned v = 0xffffff & *(const unsigned*)cur; UInt32 hashValue = _mm_crc32_u32(0, v) & LZFIND_HASH_MASK;
-#elif defined(__aarch64__) || defined(__arm__) || defined(_M_ARM64) || defined(_M_ARM)
-#include <arm_acle.h>
-#define HASH(cur) unsigned v = 0xffffff & *(const unsigned*)cur; UInt32 hashValue = __crc32cw(0, v) & LZFIND_HASH_MASK;
+#define HASH_VALUE(cur) (ZopfliCrc32c(0xffffff & *(const unsigned*)(cur)) & p->hashMask)
+#define HASH(cur) UInt32 hashValue = HASH_VALUE(cur);
+
+#if defined(__GNUC__) || defined(__clang__)
+#define MF_PREFETCH(addr) __builtin_prefetch(addr)
+#elif defined(_MSC_VER) && defined(ZOPFLI_X86)
+#define MF_PREFETCH(addr) _mm_prefetch((const char*)(addr), _MM_HINT_T0)
 #else
-extern const unsigned zopfleech_crc32_table[];
-#define HASH(cur) UInt32 hashValue = ((cur[2] | ((UInt32)cur[0] << 8)) ^ zopfleech_crc32_table[cur[1]]) & LZFIND_HASH_MASK;
+#define MF_PREFETCH(addr)
 #endif
 
+//Start loading the hash bucket of the next position while the tree of this one is walked.
+//Needs 4 readable bytes at cur + 1.
+#define PREFETCH_NEXT(cur, lenl) if ((lenl) > 4) MF_PREFETCH(&p->hash[HASH_VALUE((cur) + 1)]);
+
 #define MOVE_POS \
   ++p->cyclicBufferPos; \
   p->cyclicBufferPos &= ZOPFLI_WINDOW_MASK; \
@@ -336,6 +353,7 @@ unsigned short Bt3Zip_MatchFinder_GetMatches(CMatchFinder *p, unsigned short *di
   unsigned lenl = p->bufend - p->buffer; { if (lenl < ZOPFLI_MIN_MATCH) {return 0;}}
   const Byte *cur = p->buffer;
   HASH(cur);
+  PREFETCH_NEXT(cur, lenl);
   UInt32 curMatch = p->hash[hashValue];
   p->hash[hashValue] = p->pos;
   UInt32 offset = (UInt32)(GetMatches(lenl > ZOPFLI_MAX_MATCH ? ZOPFLI_MAX_MATCH : lenl, curMatch, MF_PARAMS(p), distances) - distances);
@@ -372,10 +390,11 @@ void Bt3Zip_MatchFinder_Skip(CMatchFinder* p, UInt32 num)
   while (num--)
   {
     const Byte *cur = p->buffer;
+    unsigned lenlimit = p->bufend - p->buffer;
     HASH(cur);
+    PREFETCH_NEXT(cur, lenlimit);
     UInt32 curMatch = p->hash[hashValue];
     p->hash[hashValue] = p->pos;
-    unsigned lenlimit = p->bufend - p->buffer;
     SkipMatches(lenlimit > ZOPFLI_MAX_MATCH ? ZOPFLI_MAX_MATCH : lenlimit, curMatch, MF_PARAMS(p));
     MOVE_POS;
   }
@@ -397,13 +416,15 @@ void Bt3Zip_MatchFinder_Skip2(CMatchFinder* p, UInt32 num)
 }
 
 void CopyMF(const CMatchFinder *p, CMatchFinder* copy){
-  copy->hash = (UInt32*)malloc(((2 * ZOPFLI_WINDOW_SIZE) + LZFIND_HASH_SIZE) * sizeof(UInt32));
+  UInt32 hashSize = p->hashMask + 1;
+  copy->hash = (UInt32*)malloc(((2 * ZOPFLI_WINDOW_SIZE) + hashSize) * sizeof(UInt32));
   if (!copy->hash)
   {
     exit(1);
   }
-  copy->son = copy->hash + LZFIND_HASH_SIZE;
-  memcpy(copy->hash, p->hash, ((2 * ZOPFLI_WINDOW_SIZE) + LZFIND_HASH_SIZE) * sizeof(UInt32));
+  copy->son = copy->hash + hashSize;
+  copy->hashMask = p->hashMask;
+  memcpy(copy->hash, p->hash, ((2 * ZOPFLI_WINDOW_SIZE) + hashSize) * sizeof(UInt32));
 
   copy->cyclicBufferPos = p->cyclicBufferPos;
   copy->pos = p->pos;
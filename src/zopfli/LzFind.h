@@ -3,15 +3,16 @@
 
 /* Modified by Felix Hanau*/
 
+#include <stddef.h>
+
 typedef unsigned char Byte;
 typedef unsigned UInt32;
 
 #define LZFIND_WINDOW_SIZE 32768
 
-//This hash size works well for text and PNG data.
-#define LZFIND_HASH_LOG 15
-#define LZFIND_HASH_SIZE (1 << LZFIND_HASH_LOG)
-#define LZFIND_HASH_MASK (LZFIND_HASH_SIZE - 1)
+//Range of hash sizes, see MatchFinder_HashLog.
+#define LZFIND_HASH_LOG_MIN 12
+#define LZFIND_HASH_LOG_MAX 18
 
 typedef struct _CMatchFinder
 {
@@ -23,9 +24,12 @@ typedef struct _CMatchFinder
 
   UInt32 *hash;
   UInt32 *son;
+  UInt32 hashMask;
 } CMatchFinder;
 
-void MatchFinder_Create(CMatchFinder *p);
+//Hash size for a match finder that indexes size bytes, as a log2.
+unsigned MatchFinder_HashLog(size_t size);
+void MatchFinder_Create(CMatchFinder *p, unsigned hashLog);
 void MatchFinder_Free(CMatchFinder *p);
 
 unsigned short Bt3Zip_MatchFinder_GetMatches(CMatchFinder *p, unsigned short* distances);
@@ -0,0 +1,188 @@
+/* Adler-32 for the zlib trailer, see ZopfliAdler32 in zlib_container.h. */
+
+#include "zlib_container.h"
+#include "cpu.h"
+
+#ifdef ZOPFLI_X86
+#include <immintrin.h>
+#elif defined(ZOPFLI_NEON)
+#include <arm_neon.h>
+#endif
+
+#define ADLER_BASE 65521
+/* Largest n such that 255n(n+1)/2 + (n+1)(BASE-1) fits in 32 bits. */
+#define ADLER_NMAX 5552
+/* Bytes per vector step. ADLER_NMAX is rounded down to a multiple of it. */
+#define ADLER_BLOCK 32
+
+static unsigned Adler32Scalar(unsigned adler, const unsigned char* data, size_t size) {
+  unsigned s1 = adler & 0xffff, s2 = adler >> 16;
+
+  while (size > 0) {
+    size_t amount = size > ADLER_NMAX ? ADLER_NMAX : size;
+    size -= amount;
+#ifdef __GNUC__
+#pragma GCC unroll 1 /* no unroll */
+#endif
+    do {
+      s1 += (*data++);
+      s2 += s1;
+      amount--;
+    } while (amount > 0);
+    s1 %= ADLER_BASE;
+    s2 %= ADLER_BASE;
+  }
+
+  return (s2 << 16) | s1;
+}
+
+/*
+The vector kernels take 32 byte blocks. Per block, s2 gains 32 * s1 plus the
+bytes weighted 32 down to 1, and s1 gains the plain byte sum. The 32 * s1 terms
+are summed once per run of blocks, the weighted sums with multiply-add.
+*/
+
+#ifdef ZOPFLI_X86
+static ZOPFLI_TARGET("ssse3") unsigned Adler32SSSE3(unsigned adler, const unsigned char* data, size_t size) {
+  unsigned s1 = adler & 0xffff, s2 = adler >> 16;
+  size_t blocks = size / ADLER_BLOCK;
+  const __m128i tap1 = _mm_setr_epi8(32, 31, 30, 29, 28, 27, 26, 25, 24, 23, 22, 21, 20, 19, 18, 17);
+  const __m128i tap2 = _mm_setr_epi8(16, 15, 14, 13, 12, 11, 10, 9, 8, 7, 6, 5, 4, 3, 2, 1);
+  const __m128i zero = _mm_setzero_si128();
+  const __m128i ones = _mm_set1_epi16(1);
+
+  size -= blocks * ADLER_BLOCK;
+  while (blocks) {
+    unsigned n = ADLER_NMAX / ADLER_BLOCK;
+    if (n > blocks) n = blocks;
+    blocks -= n;
+
+    /* s1 of each earlier block, times 32 at the end. */
+    __m128i v_ps = _mm_cvtsi32_si128(s1 * n);
+    __m128i v_s1 = zero;
+    __m128i v_s2 = _mm_cvtsi32_si128(s2);
+    do {
+      __m128i bytes1 = _mm_loadu_si128((const __m128i*)data);
+      __m128i bytes2 = _mm_loadu_si128((const __m128i*)(data + 16));
+      v_ps = _mm_add_epi32(v_ps, v_s1);
+      v_s1 = _mm_add_epi32(v_s1, _mm_sad_epu8(bytes1, zero));
+      v_s2 = _mm_add_epi32(v_s2, _mm_madd_epi16(_mm_maddubs_epi16(bytes1, tap1), ones));
+      v_s1 = _mm_add_epi32(v_s1, _mm_sad_epu8(bytes2, zero));
+      v_s2 = _mm_add_epi32(v_s2, _mm_madd_epi16(_mm_maddubs_epi16(bytes2, tap2), ones));
+      data += ADLER_BLOCK;
+    } while (--n);
+    v_s2 = _mm_add_epi32(v_s2, _mm_slli_epi32(v_ps, 5));
+
+    v_s1 = _mm_add_epi32(v_s1, _mm_shuffle_epi32(v_s1, _MM_SHUFFLE(2, 3, 0, 1)));
+    v_s1 = _mm_add_epi32(v_s1, _mm_shuffle_epi32(v_s1, _MM_SHUFFLE(1, 0, 3, 2)));
+    s1 += _mm_cvtsi128_si32(v_s1);
+    v_s2 = _mm_add_epi32(v_s2, _mm_shuffle_epi32(v_s2, _MM_SHUFFLE(2, 3, 0, 1)));
+    v_s2 = _mm_add_epi32(v_s2, _mm_shuffle_epi32(v_s2, _MM_SHUFFLE(1, 0, 3, 2)));
+    s2 = _mm_cvtsi128_si32(v_s2);
+    s1 %= ADLER_BASE;
+    s2 %= ADLER_BASE;
+  }
+  return Adler32Scalar((s2 << 16) | s1, data, size);
+}
+
+static ZOPFLI_TARGET("avx2") unsigned Adler32AVX2(unsigned adler, const unsigned char* data, size_t size) {
+  unsigned s1 = adler & 0xffff, s2 = adler >> 16;
+  size_t blocks = size / ADLER_BLOCK;
+  const __m256i tap = _mm256_setr_epi8(32, 31, 30, 29, 28, 27, 26, 25, 24, 23, 22, 21, 20, 19, 18, 17,
+                                       16, 15, 14, 13, 12, 11, 10, 9, 8, 7, 6, 5, 4, 3, 2, 1);
+  const __m256i zero = _mm256_setzero_si256();
+  const __m256i ones = _mm256_set1_epi16(1);
+
+  size -= blocks * ADLER_BLOCK;
+  while (blocks) {
+    unsigned n = ADLER_NMAX / ADLER_BLOCK;
+    if (n > blocks) n = blocks;
+    blocks -= n;
+
+    __m256i v_ps = _mm256_setr_epi32(s1 * n, 0, 0, 0, 0, 0, 0, 0);
+    __m256i v_s1 = zero;
+    __m256i v_s2 = _mm256_setr_epi32(s2, 0, 0, 0, 0, 0, 0, 0);
+    do {
+      __m256i bytes = _mm256_loadu_si256((const __m256i*)data);
+      v_ps = _mm256_add_epi32(v_ps, v_s1);
+      v_s1 = _mm256_add_epi32(v_s1, _mm256_sad_epu8(bytes, zero));
+      v_s2 = _mm256_add_epi32(v_s2, _mm256_madd_epi16(_mm256_maddubs_epi16(bytes, tap), ones));
+      data += ADLER_BLOCK;
+    } while (--n);
+    v_s2 = _mm256_add_epi32(v_s2, _mm256_slli_epi32(v_ps, 5));
+
+    __m128i x1 = _mm_add_epi32(_mm256_castsi256_si128(v_s1), _mm256_extracti128_si256(v_s1, 1));
+    __m128i x2 = _mm_add_epi32(_mm256_castsi256_si128(v_s2), _mm256_extracti128_si256(v_s2, 1));
+    x1 = _mm_add_epi32(x1, _mm_shuffle_epi32(x1, _MM_SHUFFLE(1, 0, 3, 2)));
+    x2 = _mm_add_epi32(x2, _mm_shuffle_epi32(x2, _MM_SHUFFLE(2, 3, 0, 1)));
+    x2 = _mm_add_epi32(x2, _mm_shuffle_epi32(x2, _MM_SHUFFLE(1, 0, 3, 2)));
+    s1 += _mm_cvtsi128_si32(x1);
+    s2 = _mm_cvtsi128_si32(x2);
+    s1 %= ADLER_BASE;
+    s2 %= ADLER_BASE;
+  }
+  return Adler32Scalar((s2 << 16) | s1, data, size);
+}
+#endif
+
+#ifdef ZOPFLI_NEON
+static unsigned Adler32NEON(unsigned adler, const unsigned char* data, size_t size) {
+  unsigned s1 = adler & 0xffff, s2 = adler >> 16;
+  size_t blocks = size / ADLER_BLOCK;
+  static const unsigned short taps[32] = {32, 31, 30, 29, 28, 27, 26, 25, 24, 23, 22, 21, 20, 19, 18, 17,
+                                          16, 15, 14, 13, 12, 11, 10, 9, 8, 7, 6, 5, 4, 3, 2, 1};
+
+  size -= blocks * ADLER_BLOCK;
+  while (blocks) {
+    unsigned n = ADLER_NMAX / ADLER_BLOCK;
+    if (n > blocks) n = blocks;
+    blocks -= n;
+
+    uint32x4_t v_s2 = vsetq_lane_u32(s1 * n, vdupq_n_u32(0), 0);
+    uint32x4_t v_s1 = vdupq_n_u32(0);
+    /* Per position byte sums, weighted once at the end. */
+    uint16x8_t col1 = vdupq_n_u16(0), col2 = col1, col3 = col1, col4 = col1;
+    do {
+      uint8x16_t bytes1 = vld1q_u8(data);
+      uint8x16_t bytes2 = vld1q_u8(data + 16);
+      v_s2 = vaddq_u32(v_s2, v_s1);
+      v_s1 = vpadalq_u16(v_s1, vpadalq_u8(vpaddlq_u8(bytes1), bytes2));
+      col1 = vaddw_u8(col1, vget_low_u8(bytes1));
+      col2 = vaddw_u8(col2, vget_high_u8(bytes1));
+      col3 = vaddw_u8(col3, vget_low_u8(bytes2));
+      col4 = vaddw_u8(col4, vget_high_u8(bytes2));
+      data += ADLER_BLOCK;
+    } while (--n);
+    v_s2 = vshlq_n_u32(v_s2, 5);
+    v_s2 = vmlal_u16(v_s2, vget_low_u16(col1), vld1_u16(taps));
+    v_s2 = vmlal_u16(v_s2, vget_high_u16(col1), vld1_u16(taps + 4));
+    v_s2 = vmlal_u16(v_s2, vget_low_u16(col2), vld1_u16(taps + 8));
+    v_s2 = vmlal_u16(v_s2, vget_high_u16(col2), vld1_u16(taps + 12));
+    v_s2 = vmlal_u16(v_s2, vget_low_u16(col3), vld1_u16(taps + 16));
+    v_s2 = vmlal_u16(v_s2, vget_high_u16(col3), vld1_u16(taps + 20));
+    v_s2 = vmlal_u16(v_s2, vget_low_u16(col4), vld1_u16(taps + 24));
+    v_s2 = vmlal_u16(v_s2, vget_high_u16(col4), vld1_u16(taps + 28));
+
+    uint32x2_t sum1 = vpadd_u32(vget_low_u32(v_s1), vget_high_u32(v_s1));
+    uint32x2_t sum2 = vpadd_u32(vget_low_u32(v_s2), vget_high_u32(v_s2));
+    uint32x2_t t = vpadd_u32(sum1, sum2);
+    s1 += vget_lane_u32(t, 0);
+    s2 += vget_lane_u32(t, 1);
+    s1 %= ADLER_BASE;
+    s2 %= ADLER_BASE;
+  }
+  return Adler32Scalar((s2 << 16) | s1, data, size);
+}
+#endif
+
+unsigned ZopfliAdler32(unsigned adler, const unsigned char* data, size_t size) {
+#if defined(ZOPFLI_X86)
+  ZopfliCpuInit();
+  if (zopfli_cpu >= ZOPFLI_CPU_AVX2) return Adler32AVX2(adler, data, size);
+  /* SSSE3 comes with every SSE4.2 CPU. */
+  if (zopfli_cpu >= ZOPFLI_CPU_SSE4_2) return Adler32SSSE3(adler, data, size);
+#elif defined(ZOPFLI_NEON)
+  return Adler32NEON(adler, data, size);
+#endif
+  return Adler32Scalar(adler, data, size);
+}
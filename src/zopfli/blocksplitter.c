@@ -24,66 +24,123 @@ Author: jyrki.alakuijala@gmail.com (Jyrki Alakuijala)
 #include <assert.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 
 #include "deflate.h"
 #include "lz77.h"
 #include "util.h"
 
-typedef struct SplitCostContext {
+/*
+Prefix sums of the symbol counts of an LZ77 store, sampled every interval
+entries. The counts of any range then only need counting up to half an
+interval at each end.
+*/
+typedef struct SymbolIndex {
   const unsigned short* litlens;
   const unsigned short* dists;
+  unsigned char symbols;
+  size_t interval;
+  size_t numsamples;
+  unsigned (*ll)[288];  /* Counts before entry k * interval. */
+  unsigned (*d)[32];
+} SymbolIndex;
+
+static void InitSymbolIndex(SymbolIndex* index, const unsigned short* litlens, const unsigned short* dists, size_t llsize, unsigned char symbols) {
+  size_t ll_counts[288];
+  size_t d_counts[32];
+  index->litlens = litlens;
+  index->dists = dists;
+  index->symbols = symbols;
+  /* Keeps the index near 1 MB however large the store is. */
+  index->interval = llsize / 1024 > 256 ? llsize / 1024 : 256;
+  index->numsamples = llsize / index->interval + 1;
+  index->ll = malloc(index->numsamples * sizeof(*index->ll));
+  index->d = malloc(index->numsamples * sizeof(*index->d));
+  if (!index->ll || !index->d) exit(1);
+
+  memset(index->ll[0], 0, sizeof(*index->ll));
+  memset(index->d[0], 0, sizeof(*index->d));
+  for (size_t k = 1; k < index->numsamples; k++) {
+    ZopfliLZ77Counts(litlens, dists, (k - 1) * index->interval, k * index->interval, ll_counts, d_counts, symbols);
+    ll_counts[256]--;  /* Added by ZopfliLZ77Counts. */
+    for (size_t ix = 0; ix < 288; ix++) {
+      index->ll[k][ix] = index->ll[k - 1][ix] + ll_counts[ix];
+    }
+    for (size_t ix = 0; ix < 32; ix++) {
+      index->d[k][ix] = index->d[k - 1][ix] + d_counts[ix];
+    }
+  }
+}
+
+static void CleanSymbolIndex(SymbolIndex* index) {
+  free(index->ll);
+  free(index->d);
+}
+
+/* Counts of all symbols before entry pos, from the nearest sample. */
+static void PrefixCounts(const SymbolIndex* index, size_t pos, size_t* ll_count, size_t* d_count) {
+  size_t ll_counts[288];
+  size_t d_counts[32];
+  size_t k = (pos + index->interval / 2) / index->interval;
+  if (k >= index->numsamples) k = index->numsamples - 1;
+  size_t sample = k * index->interval;
+  for (size_t ix = 0; ix < 288; ix++) ll_count[ix] = index->ll[k][ix];
+  for (size_t ix = 0; ix < 32; ix++) d_count[ix] = index->d[k][ix];
+  if (pos == sample) return;
+
+  ZopfliLZ77Counts(index->litlens, index->dists, pos < sample ? pos : sample, pos < sample ? sample : pos, ll_counts, d_counts, index->symbols);
+  ll_counts[256]--;
+  if (pos > sample) {
+    for (size_t ix = 0; ix < 288; ix++) ll_count[ix] += ll_counts[ix];
+    for (size_t ix = 0; ix < 32; ix++) d_count[ix] += d_counts[ix];
+  } else {
+    for (size_t ix = 0; ix < 288; ix++) ll_count[ix] -= ll_counts[ix];
+    for (size_t ix = 0; ix < 32; ix++) d_count[ix] -= d_counts[ix];
+  }
+}
+
+/* Same as ZopfliLZ77Counts, including the end symbol. */
+static void RangeCounts(const SymbolIndex* index, size_t start, size_t end, size_t* ll_count, size_t* d_count) {
+  size_t ll_start[288];
+  size_t d_start[32];
+  PrefixCounts(index, start, ll_start, d_start);
+  PrefixCounts(index, end, ll_count, d_count);
+  for (size_t ix = 0; ix < 288; ix++) ll_count[ix] -= ll_start[ix];
+  for (size_t ix = 0; ix < 32; ix++) d_count[ix] -= d_start[ix];
+  ll_count[256]++;
+}
+
+typedef struct SplitCostContext {
+  const SymbolIndex* index;
   size_t start;
   size_t end;
-  unsigned char symbols;
 } SplitCostContext;
 
 /*
  Gets the cost which is the sum of the cost of the left and the right section
  of the data.
  */
-static double SplitCost(size_t i, SplitCostContext* c, unsigned char searchext, unsigned entropysplit, const size_t* ll_count, const size_t* d_count, const size_t* ll_count2, const size_t* d_count2, size_t pos2) {
+static double SplitCost(size_t i, SplitCostContext* c, unsigned char searchext, unsigned entropysplit, const size_t* ll_count, const size_t* d_count) {
   double result = 3;
-  unsigned ll_lengths[288];
-  unsigned d_lengths[32];
-  unsigned dummy;
   if(i == c->end){
-    result += entropysplit ? GetDynamicLengths2(ll_lengths, d_lengths, ll_count, d_count) : GetDynamicLengthsuse(ll_lengths, d_lengths, ll_count, d_count);
-    result += CalculateTreeSize(ll_lengths, d_lengths, searchext, &dummy);
+    result += ZopfliHistogramCost(ll_count, d_count, entropysplit, searchext);
     return result;
   }
   size_t ll_counts[288];
   size_t d_counts[32];
+  /* The side that is added first: the right one if i is nearer to the end
+  than to both the start and the midpoint. */
+  size_t pos2 = c->end - (c->end - c->start) / 2;
   unsigned x = i - c->start < c->end - i;
   unsigned dist = x ? i - c->start : c->end - i;
   unsigned dist2 = i > pos2 ? i - pos2 : pos2 - i;
   if(dist2 < dist && dist2){
-    x = i > pos2;
-    if(x){
-      ZopfliLZ77Counts(c->litlens, c->dists, pos2, i, ll_counts, d_counts, c->symbols);
-      for(size_t ix = 0; ix < 286; ix++){
-        ll_counts[ix] = ll_count2[ix] + ll_counts[ix];
-      }
-      for(size_t ix = 0; ix < 30; ix++){
-        d_counts[ix] = d_count2[ix] + d_counts[ix];
-      }
-    }
-    else{
-      ZopfliLZ77Counts(c->litlens, c->dists, i, pos2, ll_counts, d_counts, c->symbols);
-      for(size_t ix = 0; ix < 286; ix++){
-        ll_counts[ix] = ll_count2[ix] - ll_counts[ix];
-      }
-      for(size_t ix = 0; ix < 30; ix++){
-        d_counts[ix] = d_count2[ix] - d_counts[ix];
-      }
-    }
-  }
-  else{
-    ZopfliLZ77Counts(c->litlens, c->dists, x ? c->start : i, x ? i : c->end, ll_counts, d_counts, c->symbols);
+    x = 1;
   }
+  RangeCounts(c->index, x ? c->start : i, x ? i : c->end, ll_counts, d_counts);
   ll_counts[256] = 1;
 
-  result += entropysplit ? GetDynamicLengths2(ll_lengths, d_lengths, ll_counts, d_counts) : GetDynamicLengthsuse(ll_lengths, d_lengths, ll_counts, d_counts);
-  result += CalculateTreeSize(ll_lengths, d_lengths, searchext, &dummy);
+  result += ZopfliHistogramCost(ll_counts, d_counts, entropysplit, searchext);
   result += 3;
   for(size_t ix = 0; ix < 286; ix++){
     ll_counts[ix] = ll_count[ix] - ll_counts[ix];
@@ -92,8 +149,7 @@ static double SplitCost(size_t i, SplitCostContext* c, unsigned char searchext,
     d_counts[ix] = d_count[ix] - d_counts[ix];
   }
   ll_counts[256] = 1;
-  result += entropysplit ? GetDynamicLengths2(ll_lengths, d_lengths, ll_counts, d_counts) : GetDynamicLengthsuse(ll_lengths, d_lengths, ll_counts, d_counts);
-  result += CalculateTreeSize(ll_lengths, d_lengths, searchext, &dummy);
+  result += ZopfliHistogramCost(ll_counts, d_counts, entropysplit, searchext);
   return result;
 }
 
@@ -102,15 +158,9 @@ Finds minimum of function f(i) where is is of type size_t, f(i) is of type
 double, i is in range start-end (excluding end).
 */
 static size_t FindMinimum(SplitCostContext* context, size_t start, size_t end, unsigned char* enough, const ZopfliOptions* options) {
-  //Count LZ77 symbols once, then, on later runs, just for 1st potential block and subtract
   size_t ll_count[288];
   size_t d_count[32];
-  size_t ll_count2[288];
-  size_t d_count2[32];
-  ZopfliLZ77Counts(context->litlens, context->dists, context->start, context->end, ll_count, d_count, context->symbols);
-  size_t pos2 = context->end - (context->end - context->start) / 2;
-  ZopfliLZ77Counts(context->litlens, context->dists, context->start, pos2, ll_count2, d_count2, context->symbols);
-
+  RangeCounts(context->index, context->start, context->end, ll_count, d_count);
 
   size_t startsize = end - start;
   /* Try to find minimum by recursively checking multiple points. */
@@ -128,7 +178,7 @@ static size_t FindMinimum(SplitCostContext* context, size_t start, size_t end, u
     if (end - start <= options->num){
       if (options->numiterations > 30){
         for (unsigned j = 0; j < end - start; j++){
-          double cost = SplitCost(start + j, context, options->searchext & 2, options->entropysplit, ll_count, d_count, ll_count2, d_count2, pos2);
+          double cost = SplitCost(start + j, context, options->searchext & 2, options->entropysplit, ll_count, d_count);
           if (cost < best){
             best = cost;
             pos = start + j;
@@ -145,7 +195,7 @@ static size_t FindMinimum(SplitCostContext* context, size_t start, size_t end, u
         vp[i] = best;
         continue;
       }
-      vp[i] = SplitCost(p[i], context, options->searchext & 2, options->entropysplit, ll_count, d_count, ll_count2, d_count2, pos2);
+      vp[i] = SplitCost(p[i], context, options->searchext & 2, options->entropysplit, ll_count, d_count);
     }
     besti = 0;
     best = vp[0];
@@ -164,7 +214,7 @@ static size_t FindMinimum(SplitCostContext* context, size_t start, size_t end, u
     pos = p[besti];
     lastbest = best;
   }
-  double origcost = SplitCost(context->end, context, options->searchext & 2, options->entropysplit, ll_count, d_count, ll_count2, d_count2, pos2);
+  double origcost = SplitCost(context->end, context, options->searchext & 2, options->entropysplit, ll_count, d_count);
   if(origcost <= best){
     pos = ostart;
   }
@@ -223,7 +273,135 @@ static int FindLargestSplittableBlock(
   return found;
 }
 
-static void ZopfliBlockSplitLZ77(const unsigned short* litlens,
+static unsigned symtox(unsigned lls){
+  if (lls <= 279){
+    return 0;
+  }
+  if (lls <= 283){
+    return 100;
+  }
+  return 200;
+}
+
+/* Uncompressed size of the LZ77 data. */
+static size_t LZ77Bytes(const SymbolIndex* index, size_t llsize) {
+  size_t bytes = 0;
+  for (size_t i = 0; i < llsize; i++) {
+    unsigned short litlen = index->litlens[i];
+    if (index->symbols) bytes += litlen < 256 ? 1 : symtox(litlen & 511) + (litlen >> 9);
+    else bytes += index->dists[i] ? litlen : 1;
+  }
+  return bytes;
+}
+
+/*
+Most block boundaries BlockSplitDP considers. The search is quadratic in it.
+Candidates are also at least noblocksplitlz entries apart.
+*/
+#define DP_MAX_CANDIDATES 512
+
+/* BlockSplitDP leaves data costing more bits per byte than this as one block
+to the recursive search, it finds nothing there. */
+#define DP_DENSE_BITS 7.5
+
+/* Entropy estimate of a block from the counts of its symbols. */
+static size_t EntropyBlockCost(const size_t* ll_counts, const size_t* d_counts) {
+  unsigned ll_lengths[288];
+  unsigned d_lengths[32];
+  unsigned dummy;
+  size_t result = 3 + GetDynamicLengths2(ll_lengths, d_lengths, ll_counts, d_counts);
+  return result + CalculateTreeSize(ll_lengths, d_lengths, 0, &dummy);
+}
+
+/*
+Splits the whole store at once: a shortest path over block boundaries at
+regular candidate positions, with entropy estimates as block costs. Every
+boundary is then moved to the cheapest position between its neighbours with
+the cost model of the recursive search.
+*/
+static void BlockSplitDP(const SymbolIndex* index, size_t llsize,
+                         size_t** splitpoints, size_t* npoints, const ZopfliOptions* options) {
+  size_t maxcand = options->noblocksplitlz ? llsize / options->noblocksplitlz : llsize;
+  if (maxcand > DP_MAX_CANDIDATES) maxcand = DP_MAX_CANDIDATES;
+  if (maxcand < 2) return;
+  size_t step = index->interval;
+  while ((llsize + step - 1) / step > maxcand) step += index->interval;
+  size_t numcand = (llsize + step - 1) / step;  /* Candidates 1..numcand, the last one is llsize. */
+  if (numcand < 2) return;
+
+  size_t all_ll[288];
+  size_t all_d[32];
+  PrefixCounts(index, llsize, all_ll, all_d);
+  all_ll[256] = 1;
+  if (EntropyBlockCost(all_ll, all_d) > DP_DENSE_BITS * LZ77Bytes(index, llsize)) return;
+
+  size_t (*ll_prefix)[288] = malloc((numcand + 1) * sizeof(*ll_prefix));
+  size_t (*d_prefix)[32] = malloc((numcand + 1) * sizeof(*d_prefix));
+  double* best = (double*)malloc((numcand + 1) * sizeof(double));
+  size_t* from = (size_t*)malloc((numcand + 1) * sizeof(size_t));
+  size_t* bounds = (size_t*)malloc((numcand + 1) * sizeof(size_t));
+  if (!ll_prefix || !d_prefix || !best || !from || !bounds) exit(1);
+  for (size_t k = 0; k <= numcand; k++) {
+    PrefixCounts(index, k == numcand ? llsize : k * step, ll_prefix[k], d_prefix[k]);
+  }
+
+  best[0] = 0;
+  for (size_t j = 1; j <= numcand; j++) {
+    best[j] = ZOPFLI_LARGE_FLOAT;
+    for (size_t i = 0; i < j; i++) {
+      size_t ll_counts[288];
+      size_t d_counts[32];
+      for (size_t ix = 0; ix < 288; ix++) ll_counts[ix] = ll_prefix[j][ix] - ll_prefix[i][ix];
+      for (size_t ix = 0; ix < 32; ix++) d_counts[ix] = d_prefix[j][ix] - d_prefix[i][ix];
+      ll_counts[256] = 1;
+      double cost = best[i] + EntropyBlockCost(ll_counts, d_counts);
+      if (cost < best[j]) {
+        best[j] = cost;
+        from[j] = i;
+      }
+    }
+  }
+
+  /* Boundaries in order, including 0 and llsize. */
+  size_t nbounds = 0;
+  for (size_t k = numcand; k; k = from[k]) nbounds++;
+  nbounds++;
+  size_t pos = nbounds;
+  for (size_t k = numcand; ; k = from[k]) {
+    bounds[--pos] = k == numcand ? llsize : k * step;
+    if (!k) break;
+  }
+
+  for (size_t b = 1; b + 1 < nbounds; b++) {
+    SplitCostContext c;
+    c.index = index;
+    c.start = bounds[b - 1];
+    c.end = bounds[b + 1];
+    size_t ll_count[288];
+    size_t d_count[32];
+    RangeCounts(index, c.start, c.end, ll_count, d_count);
+    size_t lo = bounds[b] - step / 2 > c.start ? bounds[b] - step / 2 : c.start + 1;
+    size_t hi = bounds[b] + step / 2 < c.end ? bounds[b] + step / 2 : c.end - 1;
+    size_t stride = step / 32 ? step / 32 : 1;
+    double bestcost = SplitCost(bounds[b], &c, options->searchext & 2, options->entropysplit, ll_count, d_count);
+    for (size_t i = lo; i <= hi; i += stride) {
+      double cost = SplitCost(i, &c, options->searchext & 2, options->entropysplit, ll_count, d_count);
+      if (cost < bestcost) {
+        bestcost = cost;
+        bounds[b] = i;
+      }
+    }
+    ZOPFLI_APPEND_DATA(bounds[b], splitpoints, npoints);
+  }
+
+  free(ll_prefix);
+  free(d_prefix);
+  free(best);
+  free(from);
+  free(bounds);
+}
+
+void ZopfliBlockSplitLZ77(const unsigned short* litlens,
                           const unsigned short* dists,
                           size_t llsize, size_t** splitpoints,
                           size_t* npoints, const ZopfliOptions* options, unsigned char symbols) {
@@ -233,16 +411,21 @@ static void ZopfliBlockSplitLZ77(const unsigned short* litlens,
   int splittingleft = 0;
   unsigned char* done = (unsigned char*)calloc(llsize, 1);
   if (!done) exit(1); /* Allocation failed. */
+  SymbolIndex index;
+  InitSymbolIndex(&index, litlens, dists, llsize, symbols);
   size_t lstart = 0;
   size_t lend = llsize;
-  for (;;) {
+  if (options->splitdp) {
+    /* The recursive search below goes on inside the blocks found globally. */
+    BlockSplitDP(&index, llsize, splitpoints, npoints, options);
+    if (!FindLargestSplittableBlock(llsize, done, *splitpoints, *npoints, &lstart, &lend)) lend = lstart;
+  }
+  while (lend - lstart >= options->noblocksplitlz) {
     SplitCostContext c;
 
-    c.litlens = litlens;
-    c.dists = dists;
+    c.index = &index;
     c.start = lstart;
     c.end = lend;
-    c.symbols = symbols;
     assert(lstart < lend);
     unsigned char enough = 0;
     llpos = FindMinimum(&c, lstart + 1, lend, &enough, options);
@@ -262,25 +445,12 @@ static void ZopfliBlockSplitLZ77(const unsigned short* litlens,
     if (!splittingleft) {
       break;  /* No further split will probably reduce compression. */
     }
-
-    if (lend - lstart < options->noblocksplitlz) {
-      break;
-    }
   }
 
+  CleanSymbolIndex(&index);
   free(done);
 }
 
-static unsigned symtox(unsigned lls){
-  if (lls <= 279){
-    return 0;
-  }
-  if (lls <= 283){
-    return 100;
-  }
-  return 200;
-}
-
 void ZopfliBlockSplit(const ZopfliOptions* options,
                       const unsigned char* in, size_t instart, size_t inend,
                       size_t** splitpoints, size_t* npoints, SymbolStats** stats, unsigned char twiceMode, ZopfliLZ77Store twiceStore) {
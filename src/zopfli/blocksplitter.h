@@ -51,5 +51,15 @@ npoints: pointer to amount of splitpoints, for the dynamic array. The amount of
 void ZopfliBlockSplit(const ZopfliOptions* options, const unsigned char* in, size_t instart,
                       size_t inend, size_t** splitpoints, size_t* npoints, SymbolStats** stats, unsigned char twiceMode, ZopfliLZ77Store twiceStore);
 
+/*
+Does blocksplitting on LZ77 data. The output splitpoints are indices in the
+LZ77 data.
+symbols: whether litlens and dists are in the form ZopfliLZ77Lazy stores.
+*/
+void ZopfliBlockSplitLZ77(const unsigned short* litlens,
+                          const unsigned short* dists,
+                          size_t llsize, size_t** splitpoints,
+                          size_t* npoints, const ZopfliOptions* options, unsigned char symbols);
+
 
 #endif  /* ZOPFLI_BLOCKSPLITTER_H_ */
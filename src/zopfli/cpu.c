@@ -0,0 +1,133 @@
+/* Runtime CPU feature detection, see cpu.h. */
+
+#include "cpu.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(_MSC_VER) && defined(ZOPFLI_X86)
+#include <intrin.h>
+#include <immintrin.h>
+#elif defined(ZOPFLI_X86) && (defined(__GNUC__) || defined(__clang__))
+#include <cpuid.h>
+#endif
+
+int zopfli_cpu = -1;
+int zopfli_cpu_clmul = 0;
+
+/* CRC-32C polynomial: 0x82f63b78 */
+const unsigned zopfli_crc32c_table[256] = {
+           0u, 4067132163u, 3778769143u,  324072436u, 3348797215u,  904991772u,
+   648144872u, 3570033899u, 2329499855u, 2024987596u, 1809983544u, 2575936315u,
+  1296289744u, 3207089363u, 2893594407u, 1578318884u,  274646895u, 3795141740u,
+  4049975192u,   51262619u, 3619967088u,  632279923u,  922689671u, 3298075524u,
+  2592579488u, 1760304291u, 2075979607u, 2312596564u, 1562183871u, 2943781820u,
+  3156637768u, 1313733451u,  549293790u, 3537243613u, 3246849577u,  871202090u,
+  3878099393u,  357341890u,  102525238u, 4101499445u, 2858735121u, 1477399826u,
+  1264559846u, 3107202533u, 1845379342u, 2677391885u, 2361733625u, 2125378298u,
+   820201905u, 3263744690u, 3520608582u,  598981189u, 4151959214u,   85089709u,
+   373468761u, 3827903834u, 3124367742u, 1213305469u, 1526817161u, 2842354314u,
+  2107672161u, 2412447074u, 2627466902u, 1861252501u, 1098587580u, 3004210879u,
+  2688576843u, 1378610760u, 2262928035u, 1955203488u, 1742404180u, 2511436119u,
+  3416409459u,  969524848u,  714683780u, 3639785095u,  205050476u, 4266873199u,
+  3976438427u,  526918040u, 1361435347u, 2739821008u, 2954799652u, 1114974503u,
+  2529119692u, 1691668175u, 2005155131u, 2247081528u, 3690758684u,  697762079u,
+   986182379u, 3366744552u,  476452099u, 3993867776u, 4250756596u,  255256311u,
+  1640403810u, 2477592673u, 2164122517u, 1922457750u, 2791048317u, 1412925310u,
+  1197962378u, 3037525897u, 3944729517u,  427051182u,  170179418u, 4165941337u,
+   746937522u, 3740196785u, 3451792453u, 1070968646u, 1905808397u, 2213795598u,
+  2426610938u, 1657317369u, 3053634322u, 1147748369u, 1463399397u, 2773627110u,
+  4215344322u,  153784257u,  444234805u, 3893493558u, 1021025245u, 3467647198u,
+  3722505002u,  797665321u, 2197175160u, 1889384571u, 1674398607u, 2443626636u,
+  1164749927u, 3070701412u, 2757221520u, 1446797203u,  137323447u, 4198817972u,
+  3910406976u,  461344835u, 3484808360u, 1037989803u,  781091935u, 3705997148u,
+  2460548119u, 1623424788u, 1939049696u, 2180517859u, 1429367560u, 2807687179u,
+  3020495871u, 1180866812u,  410100952u, 3927582683u, 4182430767u,  186734380u,
+  3756733383u,  763408580u, 1053836080u, 3434856499u, 2722870694u, 1344288421u,
+  1131464017u, 2971354706u, 1708204729u, 2545590714u, 2229949006u, 1988219213u,
+   680717673u, 3673779818u, 3383336350u, 1002577565u, 4010310262u,  493091189u,
+   238226049u, 4233660802u, 2987750089u, 1082061258u, 1395524158u, 2705686845u,
+  1972364758u, 2279892693u, 2494862625u, 1725896226u,  952904198u, 3399985413u,
+  3656866545u,  731699698u, 4283874585u,  222117402u,  510512622u, 3959836397u,
+  3280807620u,  837199303u,  582374963u, 3504198960u,   68661723u, 4135334616u,
+  3844915500u,  390545967u, 1230274059u, 3141532936u, 2825850620u, 1510247935u,
+  2395924756u, 2091215383u, 1878366691u, 2644384480u, 3553878443u,  565732008u,
+   854102364u, 3229815391u,  340358836u, 3861050807u, 4117890627u,  119113024u,
+  1493875044u, 2875275879u, 3090270611u, 1247431312u, 2660249211u, 1828433272u,
+  2141937292u, 2378227087u, 3811616794u,  291187481u,   34330861u, 4032846830u,
+   615137029u, 3603020806u, 3314634738u,  939183345u, 1776939221u, 2609017814u,
+  2295496738u, 2058945313u, 2926798794u, 1545135305u, 1330124605u, 3173225534u,
+  4084100981u,   17165430u,  307568514u, 3762199681u,  888469610u, 3332340585u,
+  3587147933u,  665062302u, 2042050490u, 2346497209u, 2559330125u, 1793573966u,
+  3190661285u, 1279665062u, 1595330642u, 2910671697u
+};
+
+static int DetectCpu(void) {
+#if defined(ZOPFLI_X86) && defined(_MSC_VER)
+  int info[4];
+  int level = ZOPFLI_CPU_GENERIC;
+  __cpuid(info, 0);
+  if (info[0] < 1) return level;
+  int maxleaf = info[0];
+  __cpuid(info, 1);
+  if (!(info[3] & (1 << 26))) return level;
+  level = ZOPFLI_CPU_SSE2;
+  if (!(info[2] & (1 << 19)) || !(info[2] & (1 << 20))) return level;
+  level = ZOPFLI_CPU_SSE4_2;
+  /* AVX also needs the OS to save the ymm registers. */
+  if (!(info[2] & (1 << 28)) || !(info[2] & (1 << 27)) || (_xgetbv(0) & 6) != 6) return level;
+  level = ZOPFLI_CPU_AVX;
+  if (maxleaf < 7) return level;
+  __cpuidex(info, 7, 0);
+  if (!(info[1] & (1 << 5))) return level;
+  level = ZOPFLI_CPU_AVX2;
+  /* The OS must also save the opmask and zmm registers. */
+  if ((info[1] & (1 << 16)) && (_xgetbv(0) & 0xe6) == 0xe6) level = ZOPFLI_CPU_AVX512;
+  return level;
+#elif defined(ZOPFLI_X86) && (defined(__GNUC__) || defined(__clang__))
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx512f")) return ZOPFLI_CPU_AVX512;
+  if (__builtin_cpu_supports("avx2")) return ZOPFLI_CPU_AVX2;
+  if (__builtin_cpu_supports("avx")) return ZOPFLI_CPU_AVX;
+  if (__builtin_cpu_supports("sse4.2")) return ZOPFLI_CPU_SSE4_2;
+  if (__builtin_cpu_supports("sse2")) return ZOPFLI_CPU_SSE2;
+  return ZOPFLI_CPU_GENERIC;
+#else
+  return ZOPFLI_CPU_GENERIC;
+#endif
+}
+
+/* PCLMULQDQ does not follow the levels, some SSE4.2 CPUs lack it. */
+static int DetectClmul(void) {
+#if defined(ZOPFLI_X86) && defined(_MSC_VER)
+  int info[4];
+  __cpuid(info, 0);
+  if (info[0] < 1) return 0;
+  __cpuid(info, 1);
+  return (info[2] >> 1) & 1;
+#elif defined(ZOPFLI_X86) && (defined(__GNUC__) || defined(__clang__))
+  unsigned a, b, c, d;
+  if (!__get_cpuid(1, &a, &b, &c, &d)) return 0;
+  return (c >> 1) & 1;
+#else
+  return 0;
+#endif
+}
+
+void ZopfliCpuInit(void) {
+  static const char* const names[] = {"generic", "sse2", "sse4.2", "avx", "avx2", "avx512"};
+  if (zopfli_cpu >= 0) return;
+  int level = DetectCpu();
+  const char* env = getenv("ZOPFLEECH_CPU");
+  if (env) {
+    int i;
+    for (i = 0; i < (int)(sizeof(names) / sizeof(names[0])); i++) {
+      if (!strcmp(env, names[i])) {
+        if (i < level) level = i;
+        break;
+      }
+    }
+  }
+  zopfli_cpu_clmul = level >= ZOPFLI_CPU_SSE4_2 && DetectClmul();
+  zopfli_cpu = level;
+}
@@ -0,0 +1,83 @@
+/*
+Runtime CPU feature detection. The library is built for the baseline ISA of
+the target and the hot kernels are compiled for several instruction set levels
+next to each other; the best one the running CPU supports is picked on first
+use. Setting the environment variable ZOPFLEECH_CPU to one of "generic",
+"sse2", "sse4.2", "avx", "avx2" or "avx512" lowers the selected level for
+testing.
+Output does not depend on the selected level.
+*/
+
+#ifndef ZOPFLI_CPU_H_
+#define ZOPFLI_CPU_H_
+
+#include "util.h"
+
+#define ZOPFLI_CPU_GENERIC 0
+#define ZOPFLI_CPU_SSE2 1
+#define ZOPFLI_CPU_SSE4_2 2 /* also implies SSE4.1 */
+#define ZOPFLI_CPU_AVX 3
+#define ZOPFLI_CPU_AVX2 4
+#define ZOPFLI_CPU_AVX512 5 /* AVX-512F */
+
+#if defined(__i386__) || defined(__x86_64__) || defined(_M_IX86) || defined(_M_X64)
+#define ZOPFLI_X86 1
+#endif
+/* NEON is part of the aarch64 baseline, so it is chosen at compile time. */
+#if defined(__ARM_NEON) || defined(__ARM_NEON__) || defined(_M_ARM64)
+#define ZOPFLI_NEON 1
+#endif
+
+/* Target attribute for functions using instructions above the baseline. MSVC
+allows all intrinsics without one. */
+#if defined(ZOPFLI_X86) && (defined(__GNUC__) || defined(__clang__))
+#define ZOPFLI_TARGET(isa) __attribute__((__target__(isa)))
+#else
+#define ZOPFLI_TARGET(isa)
+#endif
+
+/* Selected level, valid after ZopfliCpuInit. */
+extern int zopfli_cpu;
+/* Whether PCLMULQDQ may be used. Off below the sse4.2 level. */
+extern int zopfli_cpu_clmul;
+
+/* Detects the CPU once. Cheap to call again; call it before starting threads. */
+void ZopfliCpuInit(void);
+
+extern const unsigned zopfli_crc32c_table[256];
+
+/*
+CRC-32C of the 4 bytes of v without pre- or postconditioning, as computed by
+the SSE4.2 and ARMv8 crc32c instructions. Used for hashing, so every build and
+every CPU must get the same value.
+*/
+#if defined(ZOPFLI_HAVE_SSE4_2)
+#include <nmmintrin.h>
+#define ZopfliCrc32c(v) _mm_crc32_u32(0, v)
+#elif (defined(__ARM_FEATURE_CRC32) && !defined(_MSC_VER)) || defined(_M_ARM64)
+#if !defined(_MSC_VER)
+#include <arm_acle.h>
+#endif
+#define ZopfliCrc32c(v) __crc32cw(0, v)
+#else
+#if defined(_MSC_VER) && defined(ZOPFLI_X86)
+#include <nmmintrin.h>
+#endif
+static ZOPFLI_INLINE unsigned ZopfliCrc32c(unsigned v) {
+#if defined(ZOPFLI_X86) && (defined(__GNUC__) || defined(__clang__))
+  if (likely(zopfli_cpu >= ZOPFLI_CPU_SSE4_2)) {
+    unsigned crc = 0;
+    __asm__("crc32l %1, %0" : "+r"(crc) : "rm"(v));
+    return crc;
+  }
+#elif defined(ZOPFLI_X86) && defined(_MSC_VER)
+  if (likely(zopfli_cpu >= ZOPFLI_CPU_SSE4_2)) return _mm_crc32_u32(0, v);
+#endif
+  v = zopfli_crc32c_table[v & 0xff] ^ (v >> 8);
+  v = zopfli_crc32c_table[v & 0xff] ^ (v >> 8);
+  v = zopfli_crc32c_table[v & 0xff] ^ (v >> 8);
+  return zopfli_crc32c_table[v & 0xff] ^ (v >> 8);
+}
+#endif
+
+#endif
@@ -0,0 +1,17 @@
+/*
+CRC-32 as used by gzip, with hardware acceleration where available.
+*/
+
+#ifndef ZOPFLI_CRC32_H_
+#define ZOPFLI_CRC32_H_
+
+#include <stddef.h>
+
+/*
+Updates the CRC-32 of a stream with the next size bytes and returns it; start
+with crc 0. Uses PCLMULQDQ folding on x86 when the CPU has it, the CRC32
+instructions on ARMv8 builds with the crc extension, and slice-by-8 otherwise.
+*/
+unsigned ZopfliCRC32(unsigned crc, const unsigned char* data, size_t size);
+
+#endif
@@ -21,6 +21,7 @@ Author: jyrki.alakuijala@gmail.com (Jyrki Alakuijala)
 
 #include "deflate.h"
 #include "util.h"
+#include "cpu.h"
 #include "blocksplitter.h"
 #include "lz77.h"
 #include "squeeze.h"
@@ -28,6 +29,7 @@ Author: jyrki.alakuijala@gmail.com (Jyrki Alakuijala)
 #include "katajainen.h"
 
 #include <assert.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <limits.h>
@@ -40,59 +42,58 @@ Given the value of bp and the amount of bytes, the amount of bits represented
 is not simply bytesize * 8 + bp because even representing one bit requires a
 whole byte. It is: (bp == 0) ? (bytesize * 8) : ((bytesize - 1) * 8 + bp)
 */
-static void AddBit(int bit,
-                   unsigned char* bp, unsigned char** out, size_t* outsize) {
-  if (*bp == 0) {(*outsize)++;}
-  (*out)[*outsize - 1] |= bit << *bp;
-  *bp = (*bp + 1) & 7;
-}
 
-static void AddBits(unsigned symbol, unsigned length,
-                    unsigned char* bp, unsigned char* out, size_t* outsize) {
-//Needs:
-  //1. 32-bit arch
-  //2. 32-bit unaligned read/write
-  //3. Little endian architecture
-//As this code is not that much faster it should be ok to only enable it on x86 with MSVC, GCC and clang
-#if defined(__i386__) || defined(_M_IX86) || defined(__x86_64__) || defined(_M_X64)
-  //Length must be nonzero.
-    *(unsigned*)(&(out[*outsize - (!!(*bp))])) |= (symbol << (*bp));
-    (*outsize) += ((*bp) + length - 1) / 8 + (!(*bp));
-    *bp = (((*bp) + length) & 7);
+/*
+Writes bits LSB first through a 64-bit accumulator. Flushing stores 8 bytes at
+once, so out needs 8 bytes of room past the last byte written.
+*/
+typedef struct BitWriter {
+  unsigned char* out;
+  size_t pos;  /* Bytes flushed to out. */
+  uint64_t bits;  /* Pending bits, the first one lowest. */
+  unsigned count;  /* Number of pending bits. */
+} BitWriter;
+
+/* Continues the bit stream at bp, outsize of out. */
+static void InitBitWriter(BitWriter* w, unsigned char bp, unsigned char* out, size_t outsize) {
+  w->out = out;
+  w->pos = outsize - !!bp;
+  w->bits = bp ? out[w->pos] & ((1u << bp) - 1) : 0;
+  w->count = bp;
 }
 
-//Like AddBits, but uses "bits" for posititon
-static void AddBits2(unsigned symbol, unsigned length,
-                     unsigned char* out, size_t* bits) {
-  //Length may be zero.
-  unsigned pos = (*bits) >> 3;
-  unsigned char bitties = ((*bits) & 7);
-  *(unsigned*)(&(out[pos])) |= (symbol << bitties);
-  (*bits) += length;
-
+/* Stores the whole bytes of the accumulator. */
+static void FlushBits(BitWriter* w) {
+#if (defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__) || defined(_MSC_VER)
+  memcpy(w->out + w->pos, &w->bits, 8);
 #else
-  for (unsigned i = 0; i < length; i++) {
-    unsigned bit = (symbol >> i) & 1;
-    if (*bp == 0) {(*outsize)++;}
-    out[*outsize - 1] |= bit << *bp;
-    *bp = (*bp + 1) & 7;
+  for (unsigned i = 0; i < w->count / 8; i++) {
+    w->out[w->pos + i] = (unsigned char)(w->bits >> (i * 8));
   }
 #endif
+  w->pos += w->count >> 3;
+  w->bits >>= w->count & ~7u;
+  w->count &= 7;
 }
 
 /*
-Adds bits, like AddBits, but the order is inverted. The deflate specification
-uses both orders in one standard.
+Adds the lowest length bits of value, lowest first. Huffman codes must already
+be bit-reversed, see ZopfliLengthsToSymbols. length is at most 56.
 */
-static void AddHuffmanBits(unsigned symbol, unsigned length,
-                           unsigned char* bp, unsigned char* out,
-                           size_t* outsize) {
-  for (unsigned i = 0; i < length; i++) {
-    unsigned bit = (symbol >> (length - i - 1)) & 1;
-    if (*bp == 0) {(*outsize)++;}
-    out[*outsize - 1] |= bit << *bp;
-    *bp = (*bp + 1) & 7;
+static void WriteBits(BitWriter* w, uint64_t value, unsigned length) {
+  FlushBits(w);
+  w->bits |= value << w->count;
+  w->count += length;
+}
+
+/* Writes out the pending bits and returns the new bp and outsize. */
+static void FinishBitWriter(BitWriter* w, unsigned char* bp, size_t* outsize) {
+  FlushBits(w);
+  if (w->count) {
+    w->out[w->pos] = (unsigned char)w->bits;
   }
+  *outsize = w->pos + !!w->count;
+  *bp = w->count;
 }
 
 /*
@@ -125,6 +126,7 @@ static void PatchDistanceCodesForBuggyDecoders(unsigned* d_lengths) {
 
 /*
  Converts a series of Huffman tree bitlengths to the bit values of the symbols.
+ The codes come out bit-reversed, in the order they are written to the stream.
  */
 static void ZopfliLengthsToSymbols(const unsigned* lengths, size_t n, unsigned maxbits,
                             unsigned* symbols) {
@@ -153,8 +155,12 @@ static void ZopfliLengthsToSymbols(const unsigned* lengths, size_t n, unsigned m
   for (i = 0;  i < n; i++) {
     unsigned len = lengths[i];
     if (len) {
-      symbols[i] = next_code[len];
-      next_code[len]++;
+      unsigned code = next_code[len]++;
+      unsigned reversed = 0;
+      for (unsigned b = 0; b < len; b++) {
+        reversed = (reversed << 1) | ((code >> b) & 1);
+      }
+      symbols[i] = reversed;
     }
   }
 
@@ -163,14 +169,13 @@ static void ZopfliLengthsToSymbols(const unsigned* lengths, size_t n, unsigned m
 }
 
 /*
-Encodes the Huffman tree and returns how many bits its encoding takes. If out
+Encodes the Huffman tree and returns how many bits its encoding takes. If w
 is a null pointer, only returns the size and runs faster.
 */
 static size_t EncodeTree(const unsigned* ll_lengths,
                          const unsigned* d_lengths,
                          int use_16, int use_17, int use_18, int fuse_8, int fuse_7,
-                         unsigned char* bp,
-                         unsigned char* out, size_t* outsize) {
+                         BitWriter* w) {
   /* Runlength encoded version of lengths of litlen and dist trees. */
   struct rleinfo { unsigned rle; unsigned rle_bits; };  /* Extra bits for rle values 16, 17 and 18. */
   struct rleinfo* rle = 0;
@@ -184,7 +189,7 @@ static size_t EncodeTree(const unsigned* ll_lengths,
   static const unsigned order[19] = {
     16, 17, 18, 0, 8, 7, 9, 6, 10, 5, 11, 4, 12, 3, 13, 2, 14, 1, 15
   };
-  int size_only = !out;
+  int size_only = !w;
 
   /* Trim zeros. */
   while (hlit && ll_lengths[257 + hlit - 1] == 0) hlit--;
@@ -281,21 +286,17 @@ static size_t EncodeTree(const unsigned* ll_lengths,
     unsigned clsymbols[19];
     ZopfliLengthsToSymbols(clcl, 19, 7, clsymbols);
 
-    AddBits(hlit, 5, bp, out, outsize);
-    AddBits(hdist, 5, bp, out, outsize);
-    AddBits(hclen, 4, bp, out, outsize);
+    WriteBits(w, hlit | (hdist << 5) | (hclen << 10), 14);
 
     for (i = 0; i < hclen + 4; i++) {
-      AddBits(clcl[order[i]], 3, bp, out, outsize);
+      WriteBits(w, clcl[order[i]], 3);
     }
 
+    /* Extra bits for rle values 16, 17 and 18. */
+    static const unsigned char extra[19] = {0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 2, 3, 7};
     for (i = 0; i < rle_size; i++) {
-      unsigned symbol = clsymbols[rle[i].rle];
-      AddHuffmanBits(symbol, clcl[rle[i].rle], bp, out, outsize);
-      /* Extra bits. */
-      if (rle[i].rle == 16) AddBits(rle[i].rle_bits, 2, bp, out, outsize);
-      else if (rle[i].rle == 17) AddBits(rle[i].rle_bits, 3, bp, out, outsize);
-      else if (rle[i].rle == 18) AddBits(rle[i].rle_bits, 7, bp, out, outsize);
+      unsigned symbol = rle[i].rle;
+      WriteBits(w, clsymbols[symbol] | (rle[i].rle_bits << clcl[symbol]), clcl[symbol] + extra[symbol]);
     }
 
     free(rle);
@@ -328,7 +329,7 @@ size_t CalculateTreeSize(const unsigned* ll_lengths,
       }
       size_t size = EncodeTree(ll_lengths, d_lengths,
                                i & 1, i & 2, i & 4, i & 8, i & 16 || (hq == 1 && i == 9),
-                               0, 0, 0);
+                               0);
       if (result == 0 || size < result){
         result = size;
         *best = i;
@@ -338,7 +339,7 @@ size_t CalculateTreeSize(const unsigned* ll_lengths,
     return result;
   }
   *best = 7;
-  return EncodeTree(ll_lengths, d_lengths, 1, 1, 1, 0, 0, 0, 0, 0);
+  return EncodeTree(ll_lengths, d_lengths, 1, 1, 1, 0, 0, 0);
 }
 
 /*
@@ -346,38 +347,16 @@ Adds all lit/len and dist codes from the lists as huffman symbols. Does not add
 end code 256. expected_data_size is the uncompressed block size, used for
 assert, but you can set it to 0 to not do the assertion.
 */
-//TODO: Rewrite for x86_64 where bitbuffer is refilled once per len/dist pair
 static void AddLZ77Data(const unsigned short* litlens,
                         const unsigned short* dists,
                         size_t lstart, size_t lend,
                         size_t expected_data_size,
-                        unsigned* ll_symbols, const unsigned* ll_lengths,
-                        unsigned* d_symbols, const unsigned* d_lengths,
-                        unsigned char* bp,
-                        unsigned char* out, size_t* outsize) {
+                        const unsigned* ll_symbols, const unsigned* ll_lengths,
+                        const unsigned* d_symbols, const unsigned* d_lengths,
+                        BitWriter* w) {
   size_t testlength = 0;
   size_t i;
-  //Revert some codes so we can choose the fast AddBits() function
-#if defined(__i386__) || defined(_M_IX86) || defined(__x86_64__) || defined(_M_X64)
-
-  for (i = 0; i < 30; i++){
-    for (unsigned j = 0; j < d_lengths[i] / 2; j++){
-      unsigned bit = d_symbols[i] & (1 << j);
-      unsigned bit2 = d_symbols[i] & (1 << (d_lengths[i] - j - 1));
-      d_symbols[i] &= UINT_MAX - (1 << j) - (1 << (d_lengths[i] - j - 1));
-      d_symbols[i] |= (!!bit) << (d_lengths[i] - j - 1);
-      d_symbols[i] |= (!!bit2) << j;
-    }
-  }
-  for (i = 0; i < 286; i++){
-    for (unsigned j = 0; j < ll_lengths[i] / 2; j++){
-      unsigned bit = ll_symbols[i] & (1 << j);
-      unsigned bit2 = ll_symbols[i] & (1 << (ll_lengths[i] - j - 1));
-      ll_symbols[i] &= UINT_MAX - (1 << j) - (1 << (ll_lengths[i] - j - 1));
-      ll_symbols[i] |= (!!bit) << (ll_lengths[i] - j - 1);
-      ll_symbols[i] |= (!!bit2) << j;
-    }
-  }
+  /* Length code and length extra bits, written together. */
   unsigned len_symbols[259];
   unsigned len_lengths[259];
   for (i = 3; i < 259; i++){
@@ -390,67 +369,30 @@ static void AddLZ77Data(const unsigned short* litlens,
     }
   }
 
-  size_t bits = (*outsize) * 8 + *bp - ((*bp) != 0) * 8;
-
-#define setbits AddBits
-#define FAST_BITWRITER
-#else
-#define setbits AddHuffmanBits
-#endif
-
   for (i = lstart; i < lend; i++) {
     unsigned dist = dists[i];
     unsigned litlen = litlens[i];
     if (dist == 0) {
       assert(litlen < 256);
       assert(ll_lengths[litlen] > 0);
-#ifdef FAST_BITWRITER
-      AddBits2(ll_symbols[litlen], ll_lengths[litlen], out, &bits);
-#else
-      AddHuffmanBits(ll_symbols[litlen], ll_lengths[litlen], bp, out, outsize);
-#endif
+      WriteBits(w, ll_symbols[litlen], ll_lengths[litlen]);
 
       testlength++;
     } else {
       assert(litlen >= 3 && litlen <= ZOPFLI_MAX_MATCH);
       unsigned ds = ZopfliGetDistSymbol(dist);
+      assert(ll_lengths[ZopfliGetLengthSymbol(litlen)]);
       assert(d_lengths[ds]);
 
-
-#ifdef FAST_BITWRITER
-      AddBits2(len_symbols[litlen],
-               len_lengths[litlen],
-               out, &bits);
-
-      AddBits2(d_symbols[ds], d_lengths[ds], out, &bits);
-
-      AddBits2(ZopfliGetDistExtraBitsValue(dist),
-               ZopfliGetDistExtraBits(dist),
-               out, &bits);
-#else
-      unsigned lls = ZopfliGetLengthSymbol(litlen);
-      assert(ll_lengths[lls]);
-
-      AddHuffmanBits(ll_symbols[lls], ll_lengths[lls], bp, out, outsize);
-      AddBits(ZopfliGetLengthExtraBitsValue(litlen),
-              ZopfliGetLengthExtraBits(litlen),
-              bp, out, outsize);
-
-      AddHuffmanBits(d_symbols[ds], d_lengths[ds], bp, out, outsize);
-      AddBits(ZopfliGetDistExtraBitsValue(dist),
-              ZopfliGetDistExtraBits(dist),
-              bp, out, outsize);
-#endif
+      /* At most 25 + 28 bits for the whole match. */
+      unsigned dbits = d_lengths[ds] + ZopfliGetDistExtraBits(dist);
+      uint64_t dcode = d_symbols[ds] | (ZopfliGetDistExtraBitsValue(dist) << d_lengths[ds]);
+      WriteBits(w, len_symbols[litlen] | (dcode << len_lengths[litlen]), len_lengths[litlen] + dbits);
 
       testlength += litlen;
     }
   }
 
-#ifdef FAST_BITWRITER
-  *bp = bits & 7;
-  (*outsize) = (bits / 8) + ((bits & 7) != 0);
-#endif
-
   assert(testlength == expected_data_size);
 }
 
@@ -483,7 +425,7 @@ static void OptimizeHuffmanCountsForRlezop(int length, size_t* counts) {
 
   /* 2) Let's mark all population counts that already can be encoded
    with an rle code.*/
-  unsigned char* good_for_rle = (unsigned char*)calloc(length, 1);
+  unsigned char good_for_rle[288] = {0};
 
   /* Let's not spoil any of the existing good rle codes.
    Mark any seq of 0's that is longer than 5 as a good_for_rle.
@@ -542,8 +484,6 @@ static void OptimizeHuffmanCountsForRlezop(int length, size_t* counts) {
       sum += counts[i];
     }
   }
-
-  free(good_for_rle);
 }
 
 //From brotli.
@@ -562,10 +502,7 @@ void OptimizeHuffmanCountsForRle(int length, size_t* counts) {
 
   // 2) Let's mark all population counts that already can be encoded
   // with an rle code.
-  unsigned char* good_for_rle = (unsigned char*)calloc(length, 1);
-  if (!good_for_rle) {
-    exit(1);
-  }
+  unsigned char good_for_rle[288] = {0};
 
   // Let's not spoil any of the existing good rle codes.
   // Mark any seq of 0's that is longer as 5 as a good_for_rle.
@@ -629,7 +566,6 @@ void OptimizeHuffmanCountsForRle(int length, size_t* counts) {
       }
     }
   }
-  free(good_for_rle);
 }
 
 static size_t CalculateBlockSymbolSize(const size_t* ll_counts, const size_t* d_counts, const unsigned* ll_lengths, const unsigned* d_lengths){
@@ -837,6 +773,15 @@ size_t GetDynamicLengths2(unsigned* ll_lengths, unsigned* d_lengths, const size_
   return result;
 }
 
+size_t ZopfliHistogramCost(const size_t* ll_counts, const size_t* d_counts, unsigned entropy, unsigned char hq) {
+  unsigned ll_lengths[288];
+  unsigned d_lengths[32];
+  unsigned dummy;
+  size_t cost = entropy ? GetDynamicLengths2(ll_lengths, d_lengths, ll_counts, d_counts) : GetDynamicLengthsuse(ll_lengths, d_lengths, ll_counts, d_counts);
+  cost += CalculateTreeSize(ll_lengths, d_lengths, hq, &dummy);
+  return cost;
+}
+
 double ZopfliCalculateBlockSize(const unsigned short* litlens,
                                 const unsigned short* dists,
                                 size_t lstart, size_t lend, int btype, unsigned char hq, unsigned char symbols) {
@@ -858,13 +803,12 @@ double ZopfliCalculateBlockSize(const unsigned short* litlens,
     }
     return result;
   }
-  unsigned ll_lengths[288];
-  unsigned d_lengths[32];
-  unsigned dummy;
+  size_t ll_counts[288];
+  size_t d_counts[32];
   //TODO: Better for PNG, worse for enwik
   //result += GetAdvancedLengths(litlens, dists, lstart, lend, ll_lengths, d_lengths, symbols);
-  result += GetDynamicLengths(litlens, dists, lstart, lend, ll_lengths, d_lengths, symbols);
-  result += CalculateTreeSize(ll_lengths, d_lengths, hq, &dummy);
+  ZopfliLZ77Counts(litlens, dists, lstart, lend, ll_counts, d_counts, symbols);
+  result += ZopfliHistogramCost(ll_counts, d_counts, 0, hq);
   return result;
 }
 
@@ -926,6 +870,68 @@ static unsigned char ReplaceBadCodes(unsigned short** litlens,
   return end != *lend;
 }
 
+static void GetFixedTree(unsigned* ll_lengths, unsigned* d_lengths) {
+  size_t i;
+  for (i = 0; i < 144; i++) ll_lengths[i] = 8;
+  for (i = 144; i < 256; i++) ll_lengths[i] = 9;
+  for (i = 256; i < 280; i++) ll_lengths[i] = 7;
+  for (i = 280; i < 288; i++) ll_lengths[i] = 8;
+  for (i = 0; i < 32; i++) d_lengths[i] = 5;
+}
+
+/* Size in bits of in[instart, inend) as stored blocks written from bit bp on. */
+static size_t StoredBlocksSize(unsigned char bp, size_t instart, size_t inend) {
+  size_t result = 0;
+  size_t pos = instart;
+  do {
+    size_t len = inend - pos > 65535 ? 65535 : inend - pos;
+    result += 3 + (8 - (bp + 3) % 8) % 8 + 32 + 8 * len;
+    bp = 0;
+    pos += len;
+  } while (pos < inend);
+  return result;
+}
+
+/* Adds in[instart, inend) as stored blocks of at most 65535 bytes each. */
+static void AddStoredBlocks(int final, const unsigned char* in, size_t instart, size_t inend,
+                            unsigned char* bp, unsigned char** out, size_t* outsize) {
+  (*out) = (unsigned char*)realloc(*out, *outsize + StoredBlocksSize(*bp, instart, inend) / 8 + 8);
+  if (!(*out)){
+    exit(1);
+  }
+  size_t pos = instart;
+  do {
+    size_t len = inend - pos > 65535 ? 65535 : inend - pos;
+    memset(*out + *outsize, 0, 8);
+    BitWriter w;
+    InitBitWriter(&w, *bp, *out, *outsize);
+    WriteBits(&w, final && pos + len == inend, 3);  /* btype 00 */
+    FinishBitWriter(&w, bp, outsize);
+    *bp = 0;
+    (*out)[(*outsize)++] = len % 256;
+    (*out)[(*outsize)++] = len / 256;
+    (*out)[(*outsize)++] = 255 - len % 256;
+    (*out)[(*outsize)++] = 255 - len / 256;
+    memcpy(*out + *outsize, in + pos, len);
+    *outsize += len;
+    pos += len;
+  } while (pos < inend);
+}
+
+/*
+Whether the symbol counts of the cheap parse that block splitting made show
+that in[instart, inend) is no smaller as a fixed or dynamic block than stored.
+The optimal parse rarely finds enough on such data to make up for it.
+*/
+static int Incompressible(const SymbolStats* stats, unsigned char bp, size_t instart, size_t inend) {
+  unsigned ll_lengths[288];
+  unsigned d_lengths[32];
+  size_t stored = StoredBlocksSize(bp, instart, inend);
+  if (3 + ZopfliHistogramCost(stats->litlens, stats->dists, 0, 0) < stored) return 0;
+  GetFixedTree(ll_lengths, d_lengths);
+  return 3 + CalculateBlockSymbolSize(stats->litlens, stats->dists, ll_lengths, d_lengths) >= stored;
+}
+
 /*
 Adds a deflate block with the given LZ77 data to the output.
 options: global program options
@@ -961,12 +967,7 @@ static void AddLZ77Block(int btype, int final,
   size_t outpred;
   if (btype == 1) {
     /* Fixed block. */
-    size_t i;
-    for (i = 0; i < 144; i++) ll_lengths[i] = 8;
-    for (i = 144; i < 256; i++) ll_lengths[i] = 9;
-    for (i = 256; i < 280; i++) ll_lengths[i] = 7;
-    for (i = 280; i < 288; i++) ll_lengths[i] = 8;
-    for (i = 0; i < 32; i++) d_lengths[i] = 5;
+    GetFixedTree(ll_lengths, d_lengths);
     outpred = ZopfliCalculateBlockSize(litlens, dists, 0, lend, 1, 0, 0);
   } else{
     /* Dynamic block. */
@@ -1006,9 +1007,9 @@ static void AddLZ77Block(int btype, int final,
   }
   memset(&((*out)[*outsize]), 0, outpred / 8 + (!!(outpred & 7)) - (*outsize) + 8);
 
-  AddBit(final, bp, out, outsize);
-  AddBit(btype & 1, bp, out, outsize);
-  AddBit((btype & 2) >> 1, bp, out, outsize);
+  BitWriter w;
+  InitBitWriter(&w, *bp, *out, *outsize);
+  WriteBits(&w, final | (btype << 1), 3);
 
   if (btype == 2){
     if(advanced){
@@ -1018,16 +1019,16 @@ static void AddLZ77Block(int btype, int final,
     PatchDistanceCodesForBuggyDecoders(d_lengths);
     EncodeTree(ll_lengths, d_lengths,
                best & 1, best & 2, best & 4, best & 8 , best & 16 || (hq == 1 && best == 9 && !advanced),
-               bp, *out, outsize);
+               &w);
   }
   ZopfliLengthsToSymbols(ll_lengths, 288, 15, ll_symbols);
   ZopfliLengthsToSymbols(d_lengths, 32, 15, d_symbols);
   AddLZ77Data(litlens, dists, 0, lend
               , expected_data_size
               , ll_symbols, ll_lengths, d_symbols, d_lengths,
-              bp, *out, outsize);
-  setbits(ll_symbols[256], ll_lengths[256], bp, *out, outsize);
-#undef setbits
+              &w);
+  WriteBits(&w, ll_symbols[256], ll_lengths[256]);
+  FinishBitWriter(&w, bp, outsize);
 
   if (!(replaceCodes & 1)){
     assert(outpred == *outsize * 8 + *bp - (*bp != 0) * 8);
@@ -1055,8 +1056,8 @@ static void DeflateDynamicBlock(const ZopfliOptions* options, int final,
   }
   else{
     ZopfliLZ77Optimal2(options, in, instart, inend, &store, *costmodelnotinited, statsp, mfinexport);
+    *costmodelnotinited = 0;
   }
-  *costmodelnotinited = 0;
 
   /* For small block, encoding with fixed tree can be smaller. For large block,
   don't bother doing this expensive test, dynamic tree will be better.*/
@@ -1082,6 +1083,8 @@ static void DeflateDynamicBlock(const ZopfliOptions* options, int final,
     twiceStore->size = store.size;
   }
   else{
+    size_t prevsize = *outsize;
+    unsigned char prevbp = *bp;
     AddLZ77Block(btype, final,
                  store.litlens, store.dists, store.size,
                  blocksize, bp, out, outsize, options->searchext, in, instart, options->replaceCodes, options->advanced);
@@ -1089,6 +1092,13 @@ static void DeflateDynamicBlock(const ZopfliOptions* options, int final,
     if (!options->replaceCodes){
       ZopfliCleanLZ77Store(&store);
     }
+
+    /* Rewrite the block stored if that is smaller. */
+    if (*outsize * 8 + *bp - (*bp != 0) * 8 > prevsize * 8 + prevbp - (prevbp != 0) * 8 + StoredBlocksSize(prevbp, instart, inend)) {
+      *outsize = prevsize;
+      *bp = prevbp;
+      AddStoredBlocks(final, in, instart, inend, bp, out, outsize);
+    }
   }
 }
 
@@ -1115,10 +1125,36 @@ static void DeflateSplittingFirst(const ZopfliOptions* options,
       exit(1);
     }
   }
+  unsigned char* stored = (unsigned char*)malloc(npoints + 1);
+  if (!stored){
+    exit(1);
+  }
   for (size_t i = 0; i <= npoints; i++) {
     size_t start = i == 0 ? instart : splitpoints[i - 1];
     size_t end = i == npoints ? inend : splitpoints[i];
-    unsigned x = npoints == 0 ? 0 : i == 0 ? 2 : i == npoints ? 1 : 3;
+    stored[i] = Incompressible(&statsp[i], *bp, start, end);
+  }
+  for (size_t i = 0; i <= npoints; i++) {
+    size_t start = i == 0 ? instart : splitpoints[i - 1];
+    size_t end = i == npoints ? inend : splitpoints[i];
+    /* The match finder state is handed on between neighbouring parsed blocks. */
+    unsigned x = (i && !stored[i - 1]) | (i < npoints && !stored[i + 1]) << 1;
+    if (stored[i]) {
+      if (twiceMode & 1) {
+        /* All literals, for the block splitting of the next pass. */
+        ZopfliInitLZ77Store(stores + i);
+        stores[i].litlens = (unsigned short*)malloc((end - start) * sizeof(unsigned short));
+        stores[i].dists = (unsigned short*)calloc(end - start, sizeof(unsigned short));
+        if (!stores[i].litlens || !stores[i].dists) {
+          exit(1);
+        }
+        for (size_t j = start; j < end; j++) stores[i].litlens[j - start] = in[j];
+        stores[i].size = end - start;
+      } else {
+        AddStoredBlocks(i == npoints && final, in, start, end, bp, out, outsize);
+      }
+      continue;
+    }
     DeflateDynamicBlock(options, i == npoints && final, in, start, end,
                         bp, out, outsize, costmodelnotinited, &(statsp[i]), twiceMode, stores + i, x);
   }
@@ -1137,10 +1173,56 @@ static void DeflateSplittingFirst(const ZopfliOptions* options,
     free(stores - (npoints + 1));
   }
 
+  free(stored);
   free(splitpoints);
   free(statsp);
 }
 
+/*
+Writes the parse of ZopfliLZ77Fast as is, for levels 0 and 1. The blocks are
+split on that parse and each one is written as the smallest of a dynamic, fixed
+or stored block.
+*/
+static void DeflateFast(const ZopfliOptions* options, int final,
+                        const unsigned char* in, size_t instart, size_t inend,
+                        unsigned char* bp, unsigned char** out, size_t* outsize) {
+  ZopfliLZ77Store store;
+  ZopfliInitLZ77Store(&store);
+  ZopfliLZ77Fast(options, in, instart, inend, &store);
+
+  size_t* splitpoints = 0;
+  size_t npoints = 0;
+  if (inend - instart >= options->noblocksplit) {
+    ZopfliBlockSplitLZ77(store.litlens, store.dists, store.size, &splitpoints, &npoints, options, 0);
+  }
+
+  size_t pos = instart;
+  for (size_t i = 0; i <= npoints; i++) {
+    size_t lstart = i == 0 ? 0 : splitpoints[i - 1];
+    size_t lend = i == npoints ? store.size : splitpoints[i];
+    size_t end = pos;
+    for (size_t j = lstart; j < lend; j++) {
+      end += store.dists[j] ? store.litlens[j] : 1;
+    }
+    int blockfinal = final && i == npoints;
+    double dyncost = ZopfliCalculateBlockSize(store.litlens, store.dists, lstart, lend, 2, options->searchext, 0);
+    double fixedcost = ZopfliCalculateBlockSize(store.litlens, store.dists, lstart, lend, 1, options->searchext, 0);
+    if (StoredBlocksSize(*bp, pos, end) < (fixedcost < dyncost ? fixedcost : dyncost)) {
+      AddStoredBlocks(blockfinal, in, pos, end, bp, out, outsize);
+    }
+    else {
+      /* Without code replacement, which would reallocate the slice of the store. */
+      AddLZ77Block(fixedcost <= dyncost ? 1 : 2, blockfinal,
+                   store.litlens + lstart, store.dists + lstart, lend - lstart,
+                   end - pos, bp, out, outsize, options->searchext, in, pos, 0, 0);
+    }
+    pos = end;
+  }
+
+  free(splitpoints);
+  ZopfliCleanLZ77Store(&store);
+}
+
 /*
 Deflate a part, to allow ZopfliDeflate() to use multiple master blocks if
 needed.
@@ -1157,45 +1239,171 @@ static void ZopfliDeflatePart(const ZopfliOptions* options, int final,
   DeflateSplittingFirst(options, final, in, instart, inend, bp, out, outsize, costmodelnotinited, twiceMode, twiceStore);
 }
 
-/*TODO: in needs to be alloc'd 8 bytes past inend. This may cause crashes if code is modified and nonstandard alloc function is used for allocation of in*/
-void ZopfliDeflate(const ZopfliOptions* options, int final,
-                   const unsigned char* in, size_t insize,
-                   unsigned char* bp, unsigned char** out, size_t* outsize) {
-  if (!insize){
-    (*out) = (unsigned char*)realloc(*out, *outsize + 10);
-    AddBit(final, bp, out, outsize);
-    AddBits(1, 2, bp, *out, outsize);  // btype 01
-    AddBits(0, 7, bp, *out, outsize);
-    return;
-  }
-#if ZOPFLI_MASTER_BLOCK_SIZE == 0
-  ZopfliDeflatePart(options, final, in, 0, insize, bp, out, outsize, &costmodelnotinited);
-#else
+/*
+Ends the current byte with an empty stored block, so the next block starts on
+a byte boundary.
+*/
+static void AddEmptyStoredBlock(unsigned char* bp, unsigned char** out, size_t* outsize) {
+  (*out) = (unsigned char*)realloc(*out, *outsize + 8);
+  memset(*out + *outsize, 0, 8);
+  BitWriter w;
+  InitBitWriter(&w, *bp, *out, *outsize);
+  WriteBits(&w, 0, 3);  /* not final, btype 00 */
+  FinishBitWriter(&w, bp, outsize);
+  *bp = 0;
+  (*out)[(*outsize)++] = 0;
+  (*out)[(*outsize)++] = 0;
+  (*out)[(*outsize)++] = 255;
+  (*out)[(*outsize)++] = 255;
+}
 
-  size_t i = 0;
+/*
+Deflates in[instart, inend) master block by master block. Bytes before instart
+are used as the initial dictionary for LZ77, except past a restart point.
+*/
+static void DeflateMasterBlocks(const ZopfliOptions* options, int final,
+                                const unsigned char* in,
+                                size_t instart, size_t inend,
+                                unsigned char* bp, unsigned char** out,
+                                size_t* outsize) {
+  size_t i = instart;
   size_t msize = ZOPFLI_MASTER_BLOCK_SIZE;
+  size_t history = 0;
+  unsigned master = 0;
   unsigned char costmodelnotinited = 1;
+  ZopfliCpuInit();
+  ZopfliResetSqueeze();
+  if (options->costmodel_in && options->reuse_costmodel){
+    ZopfliSetCostModel(options->costmodel_in);
+    costmodelnotinited = 0;
+  }
   if (!options->isPNG && options->numiterations == 1){
     msize /= 5;
   }
-  while (i < insize) {
-    int masterfinal = (i + msize >= insize);
+#if ZOPFLI_MASTER_BLOCK_SIZE == 0
+  msize = inend - instart;
+#endif
+  while (i < inend) {
+    int masterfinal = (i + msize >= inend);
     int final2 = final && masterfinal;
-    size_t size = masterfinal ? insize - i : msize;
+    size_t size = masterfinal ? inend - i : msize;
+    if (options->restartinterval && master % options->restartinterval == 0) {
+      if (master) {
+        if (*bp) {
+          AddEmptyStoredBlock(bp, out, outsize);
+        }
+        history = i;
+      }
+      if (options->restartindex && !*bp) {
+        ZopfliRestartPoint point;
+        point.in = i - instart;
+        point.out = *outsize;
+        ZOPFLI_APPEND_DATA(point, &options->restartindex->points, &options->restartindex->size);
+      }
+    }
+    const unsigned char* base = in + history;
+    size_t start = i - history;
     ZopfliLZ77Store lf;
     ZopfliInitLZ77Store(&lf);
-    if (!options->twice){
-      ZopfliDeflatePart(options, final2, in, i, i + size, bp, out, outsize, &costmodelnotinited, 0, &lf);
+    if (!options->numiterations){
+      DeflateFast(options, final2, base, start, start + size, bp, out, outsize);
+    }
+    else if (!options->twice){
+      ZopfliDeflatePart(options, final2, base, start, start + size, bp, out, outsize, &costmodelnotinited, 0, &lf);
     }
     else{
       unsigned char cache = costmodelnotinited;
-      ZopfliDeflatePart(options, final2, in, i, i + size, bp, out, outsize, &costmodelnotinited, 1, &lf);
+      /* All passes parse the same data, so its matches are found once. */
+      ZopfliBeginMatchCache(options, base, start, start + size);
+      ZopfliDeflatePart(options, final2, base, start, start + size, bp, out, outsize, &costmodelnotinited, 1, &lf);
       for (unsigned it = 0; it < options->twice; it++) {
         costmodelnotinited = cache;
-        ZopfliDeflatePart(options, final2, in, i, i + size, bp, out, outsize, &costmodelnotinited, 2 + (it != options->twice - 1), &lf);
+        ZopfliDeflatePart(options, final2, base, start, start + size, bp, out, outsize, &costmodelnotinited, 2 + (it != options->twice - 1), &lf);
       }
+      ZopfliEndMatchCache();
     }
     i += size;
+    master++;
+  }
+  if (options->costmodel_out){
+    ZopfliGetCostModel(options->costmodel_out);
+  }
+  if (options->stats){
+    ZopfliAddIterationStats(options->stats);
+  }
+}
+
+/*TODO: in needs to be alloc'd 8 bytes past inend. This may cause crashes if code is modified and nonstandard alloc function is used for allocation of in*/
+void ZopfliDeflate(const ZopfliOptions* options, int final,
+                   const unsigned char* in, size_t insize,
+                   unsigned char* bp, unsigned char** out, size_t* outsize) {
+  if (!insize){
+    (*out) = (unsigned char*)realloc(*out, *outsize + 10);
+    memset(*out + *outsize, 0, 10);
+    BitWriter w;
+    InitBitWriter(&w, *bp, *out, *outsize);
+    WriteBits(&w, final | (1 << 1), 3);  // btype 01
+    WriteBits(&w, 0, 7);  // end code
+    FinishBitWriter(&w, bp, outsize);
+    return;
+  }
+  DeflateMasterBlocks(options, final, in, 0, insize, bp, out, outsize);
+}
+
+void ZopfliDeflateDict(const ZopfliOptions* options, int final,
+                       const unsigned char* dict, size_t dictsize,
+                       const unsigned char* in, size_t insize,
+                       unsigned char* bp, unsigned char** out, size_t* outsize) {
+  if (!dictsize || !insize){
+    ZopfliDeflate(options, final, in, insize, bp, out, outsize);
+    return;
+  }
+  /* Only the last window can be referenced by the first match. */
+  if (dictsize > ZOPFLI_WINDOW_SIZE){
+    dict += dictsize - ZOPFLI_WINDOW_SIZE;
+    dictsize = ZOPFLI_WINDOW_SIZE;
+  }
+  /* The match finders read up to 8 bytes past the end. */
+  unsigned char* primed = (unsigned char*)malloc(dictsize + insize + 8);
+  if (!primed){
+    exit(1);
+  }
+  memcpy(primed, dict, dictsize);
+  memcpy(primed + dictsize, in, insize);
+  memset(primed + dictsize + insize, 0, 8);
+  DeflateMasterBlocks(options, final, primed, dictsize, dictsize + insize, bp, out, outsize);
+  free(primed);
+}
+
+void ZopfliInitRestartIndex(ZopfliRestartIndex* index) {
+  index->points = 0;
+  index->size = 0;
+}
+
+void ZopfliCleanRestartIndex(ZopfliRestartIndex* index) {
+  free(index->points);
+  ZopfliInitRestartIndex(index);
+}
+
+static void AppendLEB128(size_t value, unsigned char** out, size_t* outsize) {
+  while (value >= 128) {
+    ZOPFLI_APPEND_DATA(value % 128 + 128, out, outsize);
+    value >>= 7;
+  }
+  ZOPFLI_APPEND_DATA(value, out, outsize);
+}
+
+void ZopfliSaveRestartIndex(const ZopfliRestartIndex* index,
+                            unsigned char** out, size_t* outsize) {
+  static const unsigned char magic[4] = {'Z', 'R', 'I', 1};
+  for (unsigned i = 0; i < 4; i++) {
+    ZOPFLI_APPEND_DATA(magic[i], out, outsize);
+  }
+  AppendLEB128(index->size, out, outsize);
+  ZopfliRestartPoint last = {0, 0};
+  for (size_t i = 0; i < index->size; i++) {
+    AppendLEB128(index->points[i].in - last.in, out, outsize);
+    AppendLEB128(index->points[i].out - last.out, out, outsize);
+    last = index->points[i];
   }
-#endif
 }
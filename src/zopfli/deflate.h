@@ -56,6 +56,19 @@ void ZopfliDeflate(const ZopfliOptions* options, int final,
                    const unsigned char* in, size_t insize,
                    unsigned char* bp, unsigned char** out, size_t* outsize);
 
+/*
+Same as ZopfliDeflate, but the first matches may reference a preset
+dictionary, as agreed upon out of band or through the zlib DICTID field.
+Only the last ZOPFLI_WINDOW_SIZE bytes of the dictionary are used.
+
+dict: the dictionary bytes, the data that virtually precedes in
+dictsize: number of dictionary bytes, 0 to disable the dictionary
+*/
+void ZopfliDeflateDict(const ZopfliOptions* options, int final,
+                       const unsigned char* dict, size_t dictsize,
+                       const unsigned char* in, size_t insize,
+                       unsigned char* bp, unsigned char** out, size_t* outsize);
+
 /*
 Calculates block size in bits.
 litlens: lz77 lit/lengths
@@ -73,6 +86,13 @@ size_t GetDynamicLengthsuse(unsigned* ll_lengths, unsigned* d_lengths, const siz
 size_t CalculateTreeSize(const unsigned* ll_lengths, unsigned* d_lengths, unsigned char hq, unsigned* best);
 
 size_t GetDynamicLengths2(unsigned* ll_lengths, unsigned* d_lengths, const size_t* ll_counts, const size_t* d_counts);
+
+/*
+Bits of the symbols and the tree of a dynamic block with these histograms: the
+sum of GetDynamicLengths2 (if entropy) or GetDynamicLengthsuse, and
+CalculateTreeSize.
+*/
+size_t ZopfliHistogramCost(const size_t* ll_counts, const size_t* d_counts, unsigned entropy, unsigned char hq);
 #ifdef __cplusplus
 }  // extern "C"
 #endif
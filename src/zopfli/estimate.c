@@ -0,0 +1,199 @@
+/* Compressed size estimates, see ZopfliEstimateSize in zopfli.h. */
+
+#include "zopfli.h"
+#include "deflate.h"
+#include "lz77.h"
+#include "squeeze.h"
+#include "symbols.h"
+#include "util.h"
+#include "cpu.h"
+
+#include <string.h>
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <pthread.h>
+#endif
+
+/*
+The sampled tier looks at windows of ESTIMATE_WINDOW bytes, one every
+ESTIMATE_STRIDE bytes of inputs over ESTIMATE_SAMPLE_ABOVE bytes and all of
+smaller ones. Each window is parsed greedily with 4-byte hashed matches up to
+ZOPFLI_WINDOW_SIZE back, seeing the bytes before the window too, and costs as
+one dynamic block of the symbols found.
+*/
+#define ESTIMATE_WINDOW 65536
+#define ESTIMATE_STRIDE (1 << 20)
+#define ESTIMATE_SAMPLE_ABOVE (4 << 20)
+#define ESTIMATE_HASH_BITS 16
+
+/* The other tiers parse chunks of this size independently, as one dynamic
+block each. */
+#define ESTIMATE_CHUNK (1 << 20)
+
+static unsigned HashAt(const unsigned char* in, size_t pos) {
+  unsigned v;
+  memcpy(&v, &in[pos], 4);
+  return (v * 2654435761u) >> (32 - ESTIMATE_HASH_BITS);
+}
+
+/* table: 1 << ESTIMATE_HASH_BITS entries, the last position + 1 of each hash. */
+static double WindowBits(const unsigned char* in, size_t start, size_t end, size_t* table) {
+  size_t ll_counts[288] = {0};
+  size_t d_counts[32] = {0};
+  size_t i = start;
+  while (i + 4 <= end) {
+    size_t* entry = &table[HashAt(in, i)];
+    size_t cand = *entry;
+    size_t len = 0;
+    *entry = i + 1;
+    if (cand && i + 1 - cand <= ZOPFLI_WINDOW_SIZE) {
+      size_t max = end - i < ZOPFLI_MAX_MATCH ? end - i : ZOPFLI_MAX_MATCH;
+      while (len < max && in[cand - 1 + len] == in[i + len]) len++;
+    }
+    if (len < 4) {
+      ll_counts[in[i++]]++;
+      continue;
+    }
+    ll_counts[ZopfliGetLengthSymbol(len)]++;
+    d_counts[ZopfliGetDistSymbol(i + 1 - cand)]++;
+    for (size_t j = i + 1; j < i + len && j + 4 <= end; j++) table[HashAt(in, j)] = j + 1;
+    i += len;
+  }
+  for (; i < end; i++) ll_counts[in[i]]++;
+  ll_counts[256] = 1;
+  return ZopfliHistogramCost(ll_counts, d_counts, 0, 0);
+}
+
+static size_t SampledSize(const unsigned char* in, size_t insize) {
+  size_t stride = insize > ESTIMATE_SAMPLE_ABOVE ? ESTIMATE_STRIDE : ESTIMATE_WINDOW;
+  size_t* table = (size_t*)malloc(sizeof(size_t) << ESTIMATE_HASH_BITS);
+  if (!table) exit(1); /* Allocation failed. */
+  double bits = 0;
+  size_t sampled = 0;
+  for (size_t i = 0; i < insize; i += stride) {
+    size_t size = insize - i < ESTIMATE_WINDOW ? insize - i : ESTIMATE_WINDOW;
+    if (i == 0 || stride != ESTIMATE_WINDOW) {
+      /* Not continuing the previous window, index the bytes it may reach back to. */
+      memset(table, 0, sizeof(size_t) << ESTIMATE_HASH_BITS);
+      for (size_t j = i > ZOPFLI_WINDOW_SIZE ? i - ZOPFLI_WINDOW_SIZE : 0; j < i && j + 4 <= insize; j++) {
+        table[HashAt(in, j)] = j + 1;
+      }
+    }
+    bits += WindowBits(in, i, i + size, table);
+    sampled += size;
+  }
+  free(table);
+  return (size_t)(bits * insize / sampled / 8) + 1;
+}
+
+typedef struct EstimateJobs {
+  ZopfliEstimateTier tier;
+  const unsigned char* in;
+  size_t insize;
+  double* bits;  /* Per chunk. */
+  size_t nchunks;
+  unsigned first;  /* Index of the first chunk of this worker. */
+  unsigned stride;  /* Number of workers. */
+} EstimateJobs;
+
+static double ChunkBits(ZopfliEstimateTier tier, const unsigned char* in, size_t instart, size_t inend) {
+  ZopfliOptions options;
+  ZopfliInitOptions(&options, 2, 0);
+  options.numiterations = 1;
+  options.reuse_costmodel = 0;
+
+  ZopfliLZ77Store store;
+  ZopfliInitLZ77Store(&store);
+  ZopfliLZ77Lazy(&options, in, instart, inend, &store);
+  store.symbols = 1;
+  if (tier == ZOPFLI_ESTIMATE_OPTIMAL) {
+    /* One iteration with the statistics of the lazy parse. */
+    SymbolStats stats;
+    GetStatistics(&store, &stats);
+    ZopfliCleanLZ77Store(&store);
+    ZopfliLZ77Optimal2(&options, in, instart, inend, &store, 1, &stats, 0);
+  }
+  double bits = ZopfliCalculateBlockSize(store.litlens, store.dists, 0, store.size, 2, 0, store.symbols);
+  ZopfliCleanLZ77Store(&store);
+  return bits;
+}
+
+static void EstimateChunks(EstimateJobs* jobs) {
+  for (size_t i = jobs->first; i < jobs->nchunks; i += jobs->stride) {
+    size_t end = i == jobs->nchunks - 1 ? jobs->insize : (i + 1) * ESTIMATE_CHUNK;
+    jobs->bits[i] = ChunkBits(jobs->tier, jobs->in, i * ESTIMATE_CHUNK, end);
+  }
+}
+
+#ifdef _WIN32
+static DWORD WINAPI EstimateThread(LPVOID jobs) {
+  EstimateChunks((EstimateJobs*)jobs);
+  return 0;
+}
+#else
+static void* EstimateThread(void* jobs) {
+  EstimateChunks((EstimateJobs*)jobs);
+  return 0;
+}
+#endif
+
+size_t ZopfliEstimateSize(const ZopfliOptions* options, ZopfliEstimateTier tier,
+                          const unsigned char* in, size_t insize) {
+  if (!insize) return 2;
+  if (tier == ZOPFLI_ESTIMATE_SAMPLED) return SampledSize(in, insize);
+
+  size_t nchunks = (insize + ESTIMATE_CHUNK - 1) / ESTIMATE_CHUNK;
+  unsigned nthreads = options && options->numthreads ? options->numthreads : 1;
+  if (nthreads > nchunks) nthreads = nchunks;
+  ZopfliCpuInit(); /* before the workers read it */
+  double* bits = (double*)malloc(nchunks * sizeof(double));
+  EstimateJobs* jobs = (EstimateJobs*)malloc(nthreads * sizeof(EstimateJobs));
+#ifdef _WIN32
+  HANDLE* threads = (HANDLE*)malloc(nthreads * sizeof(HANDLE));
+#else
+  pthread_t* threads = (pthread_t*)malloc(nthreads * sizeof(pthread_t));
+#endif
+  if (!bits || !jobs || !threads) {
+    exit(1);
+  }
+  for (unsigned i = 0; i < nthreads; i++) {
+    jobs[i].tier = tier;
+    jobs[i].in = in;
+    jobs[i].insize = insize;
+    jobs[i].bits = bits;
+    jobs[i].nchunks = nchunks;
+    jobs[i].first = i;
+    jobs[i].stride = nthreads;
+  }
+
+  /* The optimal parse replaces the cost model of the calling thread. */
+  ZopfliCostModel model;
+  ZopfliGetCostModel(&model);
+  /* The calling thread takes the first share of chunks. */
+  for (unsigned i = 1; i < nthreads; i++) {
+#ifdef _WIN32
+    threads[i] = CreateThread(NULL, 0, EstimateThread, &jobs[i], 0, NULL);
+    if (!threads[i]) exit(1);
+#else
+    if (pthread_create(&threads[i], NULL, EstimateThread, &jobs[i])) exit(1);
+#endif
+  }
+  EstimateChunks(&jobs[0]);
+  for (unsigned i = 1; i < nthreads; i++) {
+#ifdef _WIN32
+    WaitForSingleObject(threads[i], INFINITE);
+    CloseHandle(threads[i]);
+#else
+    pthread_join(threads[i], NULL);
+#endif
+  }
+  ZopfliSetCostModel(&model);
+
+  double total = 0;
+  for (size_t i = 0; i < nchunks; i++) total += bits[i];
+  free(threads);
+  free(jobs);
+  free(bits);
+  return (size_t)(total / 8) + 1;
+}
@@ -20,62 +20,202 @@ Author: jyrki.alakuijala@gmail.com (Jyrki Alakuijala)
 #include "deflate.h"
 #include "gzip_container.h"
 #include "util.h"
+#include "cpu.h"
+#include "crc32.h"
 #include <string.h>
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <pthread.h>
+#endif
 
-/* CRC polynomial: 0xedb88320 */
-const unsigned zopfleech_crc32_table[256] = {
-           0u, 1996959894u, 3993919788u, 2567524794u,  124634137u, 1886057615u,
-  3915621685u, 2657392035u,  249268274u, 2044508324u, 3772115230u, 2547177864u,
-   162941995u, 2125561021u, 3887607047u, 2428444049u,  498536548u, 1789927666u,
-  4089016648u, 2227061214u,  450548861u, 1843258603u, 4107580753u, 2211677639u,
-   325883990u, 1684777152u, 4251122042u, 2321926636u,  335633487u, 1661365465u,
-  4195302755u, 2366115317u,  997073096u, 1281953886u, 3579855332u, 2724688242u,
-  1006888145u, 1258607687u, 3524101629u, 2768942443u,  901097722u, 1119000684u,
-  3686517206u, 2898065728u,  853044451u, 1172266101u, 3705015759u, 2882616665u,
-   651767980u, 1373503546u, 3369554304u, 3218104598u,  565507253u, 1454621731u,
-  3485111705u, 3099436303u,  671266974u, 1594198024u, 3322730930u, 2970347812u,
-   795835527u, 1483230225u, 3244367275u, 3060149565u, 1994146192u,   31158534u,
-  2563907772u, 4023717930u, 1907459465u,  112637215u, 2680153253u, 3904427059u,
-  2013776290u,  251722036u, 2517215374u, 3775830040u, 2137656763u,  141376813u,
-  2439277719u, 3865271297u, 1802195444u,  476864866u, 2238001368u, 4066508878u,
-  1812370925u,  453092731u, 2181625025u, 4111451223u, 1706088902u,  314042704u,
-  2344532202u, 4240017532u, 1658658271u,  366619977u, 2362670323u, 4224994405u,
-  1303535960u,  984961486u, 2747007092u, 3569037538u, 1256170817u, 1037604311u,
-  2765210733u, 3554079995u, 1131014506u,  879679996u, 2909243462u, 3663771856u,
-  1141124467u,  855842277u, 2852801631u, 3708648649u, 1342533948u,  654459306u,
-  3188396048u, 3373015174u, 1466479909u,  544179635u, 3110523913u, 3462522015u,
-  1591671054u,  702138776u, 2966460450u, 3352799412u, 1504918807u,  783551873u,
-  3082640443u, 3233442989u, 3988292384u, 2596254646u,   62317068u, 1957810842u,
-  3939845945u, 2647816111u,   81470997u, 1943803523u, 3814918930u, 2489596804u,
-   225274430u, 2053790376u, 3826175755u, 2466906013u,  167816743u, 2097651377u,
-  4027552580u, 2265490386u,  503444072u, 1762050814u, 4150417245u, 2154129355u,
-   426522225u, 1852507879u, 4275313526u, 2312317920u,  282753626u, 1742555852u,
-  4189708143u, 2394877945u,  397917763u, 1622183637u, 3604390888u, 2714866558u,
-   953729732u, 1340076626u, 3518719985u, 2797360999u, 1068828381u, 1219638859u,
-  3624741850u, 2936675148u,  906185462u, 1090812512u, 3747672003u, 2825379669u,
-   829329135u, 1181335161u, 3412177804u, 3160834842u,  628085408u, 1382605366u,
-  3423369109u, 3138078467u,  570562233u, 1426400815u, 3317316542u, 2998733608u,
-   733239954u, 1555261956u, 3268935591u, 3050360625u,  752459403u, 1541320221u,
-  2607071920u, 3965973030u, 1969922972u,   40735498u, 2617837225u, 3943577151u,
-  1913087877u,   83908371u, 2512341634u, 3803740692u, 2075208622u,  213261112u,
-  2463272603u, 3855990285u, 2094854071u,  198958881u, 2262029012u, 4057260610u,
-  1759359992u,  534414190u, 2176718541u, 4139329115u, 1873836001u,  414664567u,
-  2282248934u, 4279200368u, 1711684554u,  285281116u, 2405801727u, 4167216745u,
-  1634467795u,  376229701u, 2685067896u, 3608007406u, 1308918612u,  956543938u,
-  2808555105u, 3495958263u, 1231636301u, 1047427035u, 2932959818u, 3654703836u,
-  1088359270u,  936918000u, 2847714899u, 3736837829u, 1202900863u,  817233897u,
-  3183342108u, 3401237130u, 1404277552u,  615818150u, 3134207493u, 3453421203u,
-  1423857449u,  601450431u, 3009837614u, 3294710456u, 1567103746u,  711928724u,
-  3020668471u, 3272380065u, 1510334235u,  755167117u
-};
-
-/* Returns the CRC32 */
-static unsigned crc32(unsigned crc, const unsigned char* data, size_t size) {
-  unsigned result = crc ^ 0xffffffffu;
-  for (; size > 0; size--) {
-    result = zopfleech_crc32_table[(result ^ *(data++)) & 0xff] ^ (result >> 8);
+/* BGZF members hold at most this many input bytes, so they never exceed 64 KiB. */
+#define BGZF_MAX_INPUT 65280
+
+typedef struct GzipMember {
+  const unsigned char* in;
+  size_t insize;
+  unsigned char* out;  /* Deflate data of the member. */
+  size_t outsize;
+  unsigned crc;
+  ZopfliStats stats;
+} GzipMember;
+
+typedef struct GzipMemberJobs {
+  const ZopfliOptions* options;
+  GzipMember* members;
+  size_t nmembers;
+  unsigned first;  /* Index of the first member of this worker. */
+  unsigned stride;  /* Number of workers. */
+} GzipMemberJobs;
+
+static void CompressMember(const ZopfliOptions* options, GzipMember* member, int last) {
+  ZopfliOptions memberoptions = *options;
+  unsigned char bp = 0;
+  /* Every member is a restart point anyway, and only one member may write the model. */
+  memberoptions.restartinterval = 0;
+  memberoptions.restartindex = 0;
+  memberoptions.costmodel_out = last ? options->costmodel_out : 0;
+  /* Summed up after the workers are done. */
+  member->stats.iterations = 0;
+  member->stats.iterationsskipped = 0;
+  memberoptions.stats = &member->stats;
+
+  member->crc = ZopfliCRC32(0, member->in, member->insize);
+  member->out = 0;
+  member->outsize = 0;
+  ZopfliDeflate(&memberoptions, 1, member->in, member->insize, &bp, &member->out, &member->outsize);
+  if (options->bgzf && member->outsize > member->insize + 5) {
+    /* Incompressible, a stored block keeps the member below 64 KiB. */
+    member->out = (unsigned char*)realloc(member->out, member->insize + 5);
+    if (!member->out) {
+      exit(1);
+    }
+    member->out[0] = 1;  /* final, btype 00 */
+    member->out[1] = member->insize % 256;
+    member->out[2] = member->insize >> 8;
+    member->out[3] = 255 - member->out[1];
+    member->out[4] = 255 - member->out[2];
+    memcpy(member->out + 5, member->in, member->insize);
+    member->outsize = member->insize + 5;
+  }
+}
+
+static void CompressMembers(GzipMemberJobs* jobs) {
+  for (size_t i = jobs->first; i < jobs->nmembers; i += jobs->stride) {
+    CompressMember(jobs->options, &jobs->members[i], i == jobs->nmembers - 1);
+  }
+}
+
+#ifdef _WIN32
+static DWORD WINAPI MemberThread(LPVOID jobs) {
+  CompressMembers((GzipMemberJobs*)jobs);
+  return 0;
+}
+#else
+static void* MemberThread(void* jobs) {
+  CompressMembers((GzipMemberJobs*)jobs);
+  return 0;
+}
+#endif
+
+static void AppendMember(const ZopfliOptions* options, const GzipMember* member,
+                         const unsigned char* in, unsigned time, const char* name,
+                         unsigned char** out, size_t* outsize) {
+  if (options->bgzf) {
+    size_t bsize = 18 + member->outsize + 8 - 1;
+    unsigned char hdr[18] = {31, 139, 8, 4, /* ID1 ID2 CM FLG(FEXTRA) */
+                             0, 0, 0, 0, 0, 255, /* MTIME XFL OS(unknown) */
+                             6, 0, 'B', 'C', 2, 0, /* XLEN, BC subfield of 2 bytes */
+                             bsize & 0xff, bsize >> 8 /* BSIZE: member size - 1 */
+                            };
+    ZOPFLI_APPEND_ARRAY(hdr, out, outsize);
+  } else {
+    unsigned char has_name = name && *name;
+    unsigned char hdr[10] = {31, 139, 8, has_name ? 8 : 0,
+                             time & 0xff, (time >> 8) & 0xff, (time >> 16) & 0xff, (time >> 24) & 0xff,
+                             2, 3
+                            };
+    ZOPFLI_APPEND_ARRAY(hdr, out, outsize);
+    if (has_name) ZOPFLI_APPEND_PARRAY(name, strlen(name) + 1, out, outsize);
+  }
+  if (options->restartindex) {
+    ZopfliRestartPoint point;
+    point.in = member->in - in;
+    point.out = *outsize;
+    ZOPFLI_APPEND_DATA(point, &options->restartindex->points, &options->restartindex->size);
+  }
+  if (member->outsize) ZOPFLI_APPEND_PARRAY(member->out, member->outsize, out, outsize);
+  unsigned char ftr[8] = {member->crc & 0xff, (member->crc >> 8) & 0xff, (member->crc >> 16) & 0xff, (member->crc >> 24) & 0xff,
+                          member->insize & 0xff, (member->insize >> 8) & 0xff, (member->insize >> 16) & 0xff, (member->insize >> 24) & 0xff
+                         };
+  ZOPFLI_APPEND_ARRAY(ftr, out, outsize);
+}
+
+/*
+Writes a series of gzip members, each compressed independently and in
+parallel. The name and time only go into the first member. BGZF output ends
+with an empty member, the BGZF EOF marker.
+*/
+static void GzipCompressMembers(const ZopfliOptions* options,
+                                const unsigned char* in, size_t insize,
+                                unsigned char** out, size_t* outsize,
+                                unsigned time, const char* name) {
+  size_t membersize = options->membersize;
+  if (options->bgzf && (!membersize || membersize > BGZF_MAX_INPUT)) {
+    membersize = BGZF_MAX_INPUT;
+  }
+  size_t nmembers = insize ? (insize + membersize - 1) / membersize : 1;
+  ZopfliCpuInit(); /* before the workers read it */
+  GzipMember* members = (GzipMember*)malloc((nmembers + 1) * sizeof(GzipMember));
+  if (!members) {
+    exit(1);
+  }
+  for (size_t i = 0; i < nmembers; i++) {
+    members[i].in = in + i * membersize;
+    members[i].insize = i == nmembers - 1 ? insize - i * membersize : membersize;
+  }
+
+  unsigned nthreads = options->numthreads ? options->numthreads : 1;
+  if (nthreads > nmembers) nthreads = nmembers;
+  GzipMemberJobs* jobs = (GzipMemberJobs*)malloc(nthreads * sizeof(GzipMemberJobs));
+  if (!jobs) {
+    exit(1);
   }
-  return result ^ 0xffffffffu;
+  for (unsigned i = 0; i < nthreads; i++) {
+    jobs[i].options = options;
+    jobs[i].members = members;
+    jobs[i].nmembers = nmembers;
+    jobs[i].first = i;
+    jobs[i].stride = nthreads;
+  }
+#ifdef _WIN32
+  HANDLE* threads = (HANDLE*)malloc(nthreads * sizeof(HANDLE));
+#else
+  pthread_t* threads = (pthread_t*)malloc(nthreads * sizeof(pthread_t));
+#endif
+  if (!threads) {
+    exit(1);
+  }
+  /* The calling thread takes the first share of members. */
+  for (unsigned i = 1; i < nthreads; i++) {
+#ifdef _WIN32
+    threads[i] = CreateThread(NULL, 0, MemberThread, &jobs[i], 0, NULL);
+    if (!threads[i]) exit(1);
+#else
+    if (pthread_create(&threads[i], NULL, MemberThread, &jobs[i])) exit(1);
+#endif
+  }
+  CompressMembers(&jobs[0]);
+  for (unsigned i = 1; i < nthreads; i++) {
+#ifdef _WIN32
+    WaitForSingleObject(threads[i], INFINITE);
+    CloseHandle(threads[i]);
+#else
+    pthread_join(threads[i], NULL);
+#endif
+  }
+  free(threads);
+  free(jobs);
+
+  for (size_t i = 0; i < nmembers; i++) {
+    if (options->stats) {
+      options->stats->iterations += members[i].stats.iterations;
+      options->stats->iterationsskipped += members[i].stats.iterationsskipped;
+    }
+    AppendMember(options, &members[i], in, time, i ? NULL : name, out, outsize);
+    free(members[i].out);
+  }
+  if (options->bgzf && insize) {
+    GzipMember eof = {0};
+    eof.in = in + insize;
+    ZopfliOptions eofoptions = *options;
+    eofoptions.restartindex = 0;
+    CompressMember(options, &eof, 0);
+    AppendMember(&eofoptions, &eof, in, 0, NULL, out, outsize);
+    free(eof.out);
+  }
+  free(members);
 }
 
 /* Compresses the data according to the gzip specification, RFC 1952. */
@@ -83,7 +223,11 @@ void ZopfliGzipCompressEx(const ZopfliOptions* options,
                           const unsigned char* in, size_t insize,
                           unsigned char** out, size_t* outsize,
                           unsigned time, const char* name) {
-  unsigned crc = crc32(0, in, insize);
+  if (options->membersize || options->bgzf) {
+    GzipCompressMembers(options, in, insize, out, outsize, time, name);
+    return;
+  }
+  unsigned crc = ZopfliCRC32(0, in, insize);
   unsigned char bp = 0;
   unsigned char has_name = name && *name; /* The lib just do basic check, path strip done by caller. */
   unsigned char flg = has_name ? 8 : 0;
@@ -180,6 +180,67 @@ static ZOPFLI_INLINE void node_intro_sort(Node *a, size_t n) {
   for (int i = 0; i < n; i++) a[i].weight = a[i].weight >> 9;
 }
 
+/*
+Unrestricted Huffman code lengths of the sorted leaves, computed in place
+without a heap, from the paper "In-Place Calculation of Minimum-Redundancy
+Codes" by Alistair Moffat and Jyrki Katajainen. On equal weights an internal
+node is taken before a leaf, which gives the same lengths as the package-merge
+below whenever the limit is not hit. Returns 0 without writing bitlengths if
+the longest code would exceed maxbits.
+*/
+static int MinimumRedundancyLengths(const Node* leaves, int numsymbols, int maxbits, unsigned* bitlengths) {
+  size_t a[288];
+  int root, leaf, next, avbl, used, depth;
+
+  /* Left to right, the internal nodes replace the weights and keep the index
+  of their parent. */
+  a[0] = leaves[0].weight + leaves[1].weight;
+  root = 0;
+  leaf = 2;
+  for (next = 1; next < numsymbols - 1; next++) {
+    if (leaf >= numsymbols || a[root] <= leaves[leaf].weight) {
+      a[next] = a[root];
+      a[root++] = next;
+    } else {
+      a[next] = leaves[leaf++].weight;
+    }
+    if (leaf >= numsymbols || (root < next && a[root] <= leaves[leaf].weight)) {
+      a[next] += a[root];
+      a[root++] = next;
+    } else {
+      a[next] += leaves[leaf++].weight;
+    }
+  }
+
+  /* Right to left, the depth of each internal node. */
+  a[numsymbols - 2] = 0;
+  for (next = numsymbols - 3; next >= 0; next--) {
+    a[next] = a[a[next]] + 1;
+  }
+  /* The deepest internal node is the parent of the two lightest leaves. */
+  if ((int)a[0] + 1 > maxbits) return 0;
+
+  /* Leaf depths, from the heaviest leaf down. */
+  avbl = 1;
+  used = depth = 0;
+  root = numsymbols - 2;
+  next = numsymbols - 1;
+  while (avbl > 0) {
+    while (root >= 0 && (int)a[root] == depth) {
+      used++;
+      root--;
+    }
+    while (avbl > used) {
+      bitlengths[leaves[next--].count] = depth;
+      avbl--;
+    }
+    avbl = 2 * used;
+    depth++;
+    used = 0;
+  }
+  return 1;
+}
+
 void ZopfliLengthLimitedCodeLengths(const size_t* frequencies, int n, int maxbits, unsigned* bitlengths) {
   int i;
   int numsymbols = 0;  /* Amount of symbols with frequency > 0. */
@@ -219,6 +280,8 @@ void ZopfliLengthLimitedCodeLengths(const size_t* frequencies, int n, int maxbit
 
   node_intro_sort(leaves, numsymbols);
 
+  if (MinimumRedundancyLengths(leaves, numsymbols, maxbits, bitlengths)) return;
+
   if (numsymbols - 1 < maxbits) {
     maxbits = numsymbols - 1;
   }
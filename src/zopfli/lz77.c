@@ -21,6 +21,7 @@ Author: jyrki.alakuijala@gmail.com (Jyrki Alakuijala)
 
 #include "lz77.h"
 #include "util.h"
+#include "cpu.h"
 #include "symbols.h"
 #include "match.h"
 
@@ -65,6 +66,14 @@ static void ZopfliStoreLitLenDist(unsigned short length, unsigned char dist,
   ZOPFLI_APPEND_DATA(dist, (unsigned char**)&store->dists, &size2);
 }
 
+/* Like ZopfliStoreLitLenDist, with the length and real distance of a match. */
+static void ZopfliStoreLenDist(unsigned short length, unsigned short dist,
+                               ZopfliLZ77Store* store) {
+  size_t size2 = store->size;  /* Needed for using ZOPFLI_APPEND_DATA twice. */
+  ZOPFLI_APPEND_DATA(length, &store->litlens, &store->size);
+  ZOPFLI_APPEND_DATA(dist, &store->dists, &size2);
+}
+
 #ifndef NDEBUG
 void ZopfliVerifyLenDist(const unsigned char* data, size_t datasize, size_t pos,
                          unsigned short dist, unsigned short length) {
@@ -145,21 +154,8 @@ typedef struct
   U32   nextToUpdate;     /* index from which to continue dictionary update */
 } LZ3HC_Data_Structure;
 
-#ifdef ZOPFLI_HAVE_SSE4_2
-#include <nmmintrin.h>
-static ZOPFLI_INLINE U32 LZ4HC_hashPtr(const void* ptr) { return _mm_crc32_u32(0, *(unsigned*)ptr) >> (32-HASH_LOG); }
-static ZOPFLI_INLINE U32 LZ4HC_hashPtr3(const void* ptr) { return _mm_crc32_u32(0, (*(unsigned*)ptr) & 0xFFFFFF) >> (32-HASH_LOG3); }
-#elif defined(__aarch64__) || defined(__arm__) || defined(_M_ARM64) || defined(_M_ARM)
-#include <arm_acle.h>
-static ZOPFLI_INLINE U32 LZ4HC_hashPtr(const void* ptr) { return __crc32cw(0, *(unsigned*)ptr) >> (32-HASH_LOG); }
-static ZOPFLI_INLINE U32 LZ4HC_hashPtr3(const void* ptr) { return __crc32cw(0, (*(unsigned*)ptr) & 0xFFFFFF) >> (32-HASH_LOG3); }
-#else
-#define HASH_FUNCTION(i)       (((i) * 2654435761U) >> (32-HASH_LOG))
-#define HASH_FUNCTION3(i)       (((i) * 2654435761U) >> (32-HASH_LOG3))
-
-static U32 LZ4HC_hashPtr(const void* ptr) { return HASH_FUNCTION(*(unsigned*)ptr); }
-static U32 LZ4HC_hashPtr3(const void* ptr) { return HASH_FUNCTION3((*(unsigned*)ptr) & 0xFFFFFF); }
-#endif
+static ZOPFLI_INLINE U32 LZ4HC_hashPtr(const void* ptr) { return ZopfliCrc32c(*(unsigned*)ptr) >> (32-HASH_LOG); }
+static ZOPFLI_INLINE U32 LZ4HC_hashPtr3(const void* ptr) { return ZopfliCrc32c((*(unsigned*)ptr) & 0xFFFFFF) >> (32-HASH_LOG3); }
 
 static void LZ4HC_init (LZ4HC_Data_Structure* hc4, const BYTE* start)
 {
@@ -226,7 +222,7 @@ static void LZ4HC_Insert3 (LZ3HC_Data_Structure* hc4, const BYTE* ip)
 
 static int LZ4HC_InsertAndFindBestMatch(LZ4HC_Data_Structure* hc4,   /* Index table will be updated */
                                                const BYTE* ip, const BYTE* const iLimit,
-                                               const BYTE** matchpos, size_t ml)
+                                               const BYTE** matchpos, size_t ml, int nbAttempts)
 {
   U16* const chainTable = hc4->chainTable;
   U32* const HashTable = hc4->hashTable;
@@ -234,7 +230,6 @@ static int LZ4HC_InsertAndFindBestMatch(LZ4HC_Data_Structure* hc4,   /* Index ta
   const BYTE* base2 = base + ml - 3;
   const U32 lowLimit = (2 * MAXD > (U32)(ip-base)) ? MAXD : (U32)(ip - base) - (MAXD - 1);
   const BYTE* match;
-  int nbAttempts = 650; //PNG 650//ENWIK 600/700
 
   /* HC4 match finder */
   LZ4HC_Insert(hc4, ip);
@@ -319,9 +314,27 @@ size_t ZopfliLZ77LazyLauncher(const unsigned char* in,
   return ret;
 }
 
-void ZopfliLZ77Lazy(const ZopfliOptions* options, const unsigned char* in,
-                      size_t instart, size_t inend,
-                      ZopfliLZ77Store* store) {
+/* Appends a literal or match in the form of the store, see LZ77Lazy. */
+static ZOPFLI_INLINE void StoreLiteral(unsigned char c, unsigned char symbols, ZopfliLZ77Store* store) {
+  if (symbols) ZopfliStoreLitLenDist(c, 0, store);
+  else ZopfliStoreLenDist(c, 0, store);
+}
+
+static ZOPFLI_INLINE void StoreMatch(unsigned short leng, unsigned short dist, unsigned char symbols, ZopfliLZ77Store* store) {
+  if (symbols) {
+    unsigned lls = ZopfliGetLengthSymbol(leng);
+    ZopfliStoreLitLenDist(lls + ((leng - symtox(lls)) << 9), ZopfliGetDistSymbol(dist) + 1, store);
+  }
+  else ZopfliStoreLenDist(leng, dist, store);
+}
+
+/*
+symbols: store length symbols with their extra bits above bit 9 and distance
+symbols + 1 in bytes, as ZopfliLZ77Lazy does, instead of lengths and distances.
+*/
+static void LZ77Lazy(const ZopfliOptions* options, const unsigned char* in,
+                     size_t instart, size_t inend,
+                     ZopfliLZ77Store* store, unsigned char symbols) {
   LZ4HC_Data_Structure mmc;
   LZ3HC_Data_Structure h3;
   size_t i = 0;
@@ -341,7 +354,7 @@ void ZopfliLZ77Lazy(const ZopfliOptions* options, const unsigned char* in,
 
   for (i = instart; i < inend; i++) {
     const BYTE* matchpos;
-    int y = LZ4HC_InsertAndFindBestMatch(&mmc, &in[i], &in[inend] > &in[i] + ZOPFLI_MAX_MATCH ? &in[i] + ZOPFLI_MAX_MATCH : &in[inend], &matchpos, match_available ? prev_length : 3);
+    int y = LZ4HC_InsertAndFindBestMatch(&mmc, &in[i], &in[inend] > &in[i] + ZOPFLI_MAX_MATCH ? &in[i] + ZOPFLI_MAX_MATCH : &in[inend], &matchpos, match_available ? prev_length : 3, options->chain);
 
     if (y >= 4 && i + 4 <= inend){
       dist = &in[i] - matchpos;
@@ -354,7 +367,7 @@ void ZopfliLZ77Lazy(const ZopfliOptions* options, const unsigned char* in,
         dist = &in[i] - matchpos;
       }
       else{
-        ZopfliStoreLitLenDist(in[i], 0, store);
+        StoreLiteral(in[i], symbols, store);
         continue;
       }
     }
@@ -369,16 +382,15 @@ void ZopfliLZ77Lazy(const ZopfliOptions* options, const unsigned char* in,
 
     if (leng == ZOPFLI_MAX_MATCH) {
       if (match_available) {
-        ZopfliStoreLitLenDist(in[i - 1], 0, store);
+        StoreLiteral(in[i - 1], symbols, store);
         match_available = 0;
       }
-      unsigned lls = ZopfliGetLengthSymbol(leng);
-      ZopfliStoreLitLenDist(lls + ((leng - symtox(lls)) << 9), ZopfliGetDistSymbol(dist) + 1, store);
+      StoreMatch(leng, dist, symbols, store);
       i += (leng - 1);
       if (dist == 1) {
         i++;
         while (i + ZOPFLI_MAX_MATCH <= inend && memcmp(&in[i], &in[i - 1], ZOPFLI_MAX_MATCH) == 0) {
-          ZopfliStoreLitLenDist(lls + ((leng - symtox(lls)) << 9), ZopfliGetDistSymbol(dist) + 1, store);
+          StoreMatch(leng, dist, symbols, store);
           i += leng;
         }
         i--;
@@ -388,7 +400,7 @@ void ZopfliLZ77Lazy(const ZopfliOptions* options, const unsigned char* in,
     if (match_available) {
       match_available = 0;
       if (lengthscore > prev_length + 1) {
-        ZopfliStoreLitLenDist(in[i - 1], 0, store);
+        StoreLiteral(in[i - 1], symbols, store);
         match_available = 1;
         prev_length = leng;
         prev_match = dist;
@@ -402,8 +414,7 @@ void ZopfliLZ77Lazy(const ZopfliOptions* options, const unsigned char* in,
         ZopfliVerifyLenDist(in, inend, i - 1, dist, leng);
 #endif
 
-        unsigned lls = ZopfliGetLengthSymbol(leng);
-        ZopfliStoreLitLenDist(lls + ((leng - symtox(lls)) << 9), ZopfliGetDistSymbol(dist) + 1, store);
+        StoreMatch(leng, dist, symbols, store);
         i += leng - 2;
         continue;
       }
@@ -419,10 +430,22 @@ void ZopfliLZ77Lazy(const ZopfliOptions* options, const unsigned char* in,
 #ifndef NDEBUG
     ZopfliVerifyLenDist(in, inend, i, dist, leng);
 #endif
-    unsigned lls = ZopfliGetLengthSymbol(leng);
-    ZopfliStoreLitLenDist(lls + ((leng - symtox(lls)) << 9), ZopfliGetDistSymbol(dist) + 1, store);
+    StoreMatch(leng, dist, symbols, store);
     i += leng - 1;
   }
+  store->symbols = symbols;
+}
+
+void ZopfliLZ77Lazy(const ZopfliOptions* options, const unsigned char* in,
+                      size_t instart, size_t inend,
+                      ZopfliLZ77Store* store) {
+  LZ77Lazy(options, in, instart, inend, store, 1);
+}
+
+void ZopfliLZ77Fast(const ZopfliOptions* options, const unsigned char* in,
+                    size_t instart, size_t inend,
+                    ZopfliLZ77Store* store) {
+  LZ77Lazy(options, in, instart, inend, store, 0);
 }
 
 void ZopfliLZ77Counts(const unsigned short* litlens, const unsigned short* dists, size_t start, size_t end, size_t* ll_count, size_t* d_count, unsigned char symbols) {
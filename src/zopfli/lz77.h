@@ -84,4 +84,12 @@ void ZopfliLZ77Lazy(const ZopfliOptions* options, const unsigned char* in,
                       size_t instart, size_t inend,
                       ZopfliLZ77Store* store);
 
+/*
+Same parse as ZopfliLZ77Lazy, but stores lengths and distances like
+ZopfliLZ77Optimal, so the result can be written out directly.
+*/
+void ZopfliLZ77Fast(const ZopfliOptions* options, const unsigned char* in,
+                    size_t instart, size_t inend,
+                    ZopfliLZ77Store* store);
+
 #endif  /* ZOPFLI_LZ77_H_ */
@@ -24,6 +24,7 @@ Author: jyrki.alakuijala@gmail.com (Jyrki Alakuijala)
 #include <math.h>
 #include <stdio.h>
 #include <string.h>
+#include <limits.h>
 #if _MSC_VER
 #include <malloc.h>
 #define alloca _alloca
@@ -33,14 +34,15 @@ Author: jyrki.alakuijala@gmail.com (Jyrki Alakuijala)
 #include "deflate.h"
 #include "katajainen.h"
 #include "util.h"
+#include "cpu.h"
 #include "squeeze.h"
 #include "symbols.h"
 #include "match.h"
 #include "LzFind.h"
 
-#ifdef ZOPFLI_HAVE_SSE2
+#ifdef ZOPFLI_X86
 #include <immintrin.h>
-#elif defined(__aarch64__) || defined(__arm__) || defined(_M_ARM64) || defined(_M_ARM)
+#elif defined(ZOPFLI_NEON)
 #include <arm_neon.h>
 #endif
 
@@ -135,8 +137,8 @@ static void CleanCache(LZCache* c){
   free(c->cache);
 }
 
-CMatchFinder mf;
-int right;
+static ZOPFLI_TLS CMatchFinder mf;
+static ZOPFLI_TLS int right;
 
 #include <stdint.h>
 typedef  uint8_t BYTE;
@@ -158,16 +160,7 @@ typedef struct
   U32   nextToUpdate;     /* index from which to continue dictionary update */
 } LZ3HC_Data_Structure;
 
-#ifdef ZOPFLI_HAVE_SSE4_2
-static ZOPFLI_INLINE U32 LZ4HC_hashPtr3(const void* ptr) { return _mm_crc32_u32(0, (*(unsigned*)ptr) & 0xFFFFFF) >> (32-HASH_LOG3); }
-#elif defined(__aarch64__) || defined(__arm__) || defined(_M_ARM64) || defined(_M_ARM)
-#include <arm_acle.h>
-static ZOPFLI_INLINE U32 LZ4HC_hashPtr3(const void* ptr) { return __crc32cw(0, (*(unsigned*)ptr) & 0xFFFFFF) >> (32-HASH_LOG3); }
-#else
-#define HASH_FUNCTION3(i)       (((i) * 2654435761U) >> (32-HASH_LOG3))
-
-static U32 LZ4HC_hashPtr3(const void* ptr) { return HASH_FUNCTION3((*(unsigned*)ptr) & 0xFFFFFF); }
-#endif
+static ZOPFLI_INLINE U32 LZ4HC_hashPtr3(const void* ptr) { return ZopfliCrc32c((*(unsigned*)ptr) & 0xFFFFFF) >> (32-HASH_LOG3); }
 
 static void LZ4HC_init3 (LZ3HC_Data_Structure* hc4, const BYTE* start)
 {
@@ -250,63 +243,316 @@ static int LZ4HC_InsertAndFindBestMatch3 (LZ3HC_Data_Structure* hc4,   /* Index
   return num;
 }
 
-static void GetBestLengths2(const unsigned char* in, size_t instart, size_t inend,
-                           SymbolStats* costcontext, unsigned* length_array, LZCache* c) {
-  size_t i;
+//Special handling for files with high redundancy
+#define RLE 1
+#define ML_MATCH 2
+#define ML_RLE 3
 
-  /*TODO: Put this in separate function*/
-  float litlentable [259];
-  float* disttable = (float*)malloc(ZOPFLI_WINDOW_SIZE * sizeof(float));
-  float* literals = costcontext->ll_symbols;
-  if (!disttable){
-    exit(1);
+#ifdef ZOPFLI_X86
+/* Relaxes positions curr..len of a match with AVX-512, the mask covers the tail. */
+static ZOPFLI_TARGET("avx512f") void RelaxRangeAVX512(float price2, const float* litlentable, float* costs,
+                                                      unsigned* length_array, unsigned curr, unsigned len, unsigned dist) {
+  __m512 vprice = _mm512_set1_ps(price2);
+  __m512i vlength = _mm512_add_epi32(_mm512_set1_epi32(curr + dist),
+                                     _mm512_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15));
+  for (; curr <= len; curr += 16) {
+    unsigned left = len - curr + 1;
+    __mmask16 m = left >= 16 ? 0xFFFF : (__mmask16)((1U << left) - 1);
+    __m512 x16 = _mm512_add_ps(vprice, _mm512_maskz_loadu_ps(m, &litlentable[curr]));
+    __mmask16 lt = _mm512_mask_cmp_ps_mask(m, x16, _mm512_maskz_loadu_ps(m, &costs[curr]), _CMP_LT_OQ);
+    _mm512_mask_storeu_ps(&costs[curr], lt, x16);
+    _mm512_mask_storeu_epi32(&length_array[curr], lt, vlength);
+    vlength = _mm512_add_epi32(vlength, _mm512_set1_epi32(16));
   }
-    for (i = 3; i < 259; i++){
-      litlentable[i] = costcontext->ll_symbols[ZopfliGetLengthSymbol(i)] + ZopfliGetLengthExtraBits(i);
-    }
-    for (i = 1; i < 1025; i++){
-      disttable[i] = costcontext->d_symbols[ZopfliGetDistSymbol(i)] + ZopfliGetDistExtraBits(i);
-    }
-    float counter = costcontext->d_symbols[20] + 9;
-    for (; i < 1537; i++){
-      disttable[i] = counter;
-    }
-    counter = costcontext->d_symbols[21] + 9;
-    for (; i < 2049; i++){
-      disttable[i] = counter;
-    }
-    counter = costcontext->d_symbols[22] + 10;
-    for (; i < 3073; i++){
-      disttable[i] = counter;
-    }
-    counter = costcontext->d_symbols[23] + 10;
-    for (; i < 4097; i++){
-      disttable[i] = counter;
-    }
-    counter = costcontext->d_symbols[24] + 11;
-    for (; i < 6145; i++){
-      disttable[i] = counter;
-    }
-    counter = costcontext->d_symbols[25] + 11;
-    for (; i < 8193; i++){
-      disttable[i] = counter;
-    }
-    counter = costcontext->d_symbols[26] + 12;
-    for (; i < 12289; i++){
-      disttable[i] = counter;
-    }
-    counter = costcontext->d_symbols[27] + 12;
-    for (; i < 16385; i++){
-      disttable[i] = counter;
-    }
-    counter = costcontext->d_symbols[28] + 13;
-    for (; i < 24577; i++){
-      disttable[i] = counter;
+}
+
+/* Same for the integer costs of GetBestLengthsultra2. litlentable is read 16
+bytes at a time and must be padded. */
+static ZOPFLI_TARGET("avx512f") void RelaxRangeIntAVX512(unsigned price2, const unsigned char* litlentable, unsigned* costs,
+                                                         unsigned* length_array, unsigned len, unsigned dist) {
+  unsigned curr = ZOPFLI_MIN_MATCH;
+  __m512i vprice = _mm512_set1_epi32(price2);
+  __m512i vlength = _mm512_add_epi32(_mm512_set1_epi32(curr + dist),
+                                     _mm512_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15));
+  for (; curr <= len; curr += 16) {
+    unsigned left = len - curr + 1;
+    __mmask16 m = left >= 16 ? 0xFFFF : (__mmask16)((1U << left) - 1);
+    __m512i x16 = _mm512_add_epi32(vprice, _mm512_cvtepu8_epi32(_mm_loadu_si128((const __m128i*)&litlentable[curr])));
+    __mmask16 lt = _mm512_mask_cmplt_epu32_mask(m, x16, _mm512_maskz_loadu_epi32(m, &costs[curr]));
+    _mm512_mask_storeu_epi32(&costs[curr], lt, x16);
+    _mm512_mask_storeu_epi32(&length_array[curr], lt, vlength);
+    vlength = _mm512_add_epi32(vlength, _mm512_set1_epi32(16));
+  }
+}
+#endif
+
+#ifdef ZOPFLI_NEON
+static const unsigned relax_steps[4] = {0, 1, 2, 3};
+
+/* Relaxes positions curr..len of a match with NEON, 4 at a time. */
+static ZOPFLI_INLINE void RelaxRangeNEON(float price2, const float* litlentable, float* costs,
+                                         unsigned* length_array, unsigned curr, unsigned len, unsigned dist) {
+  float32x4_t vprice = vdupq_n_f32(price2);
+  uint32x4_t vlength = vaddq_u32(vdupq_n_u32(curr + dist), vld1q_u32(relax_steps));
+  for (; curr + 3 <= len; curr += 4) {
+    float32x4_t x4 = vaddq_f32(vprice, vld1q_f32(&litlentable[curr]));
+    float32x4_t vcost = vld1q_f32(&costs[curr]);
+    vst1q_f32(&costs[curr], vminq_f32(x4, vcost));
+    vst1q_u32(&length_array[curr], vbslq_u32(vcltq_f32(x4, vcost), vlength, vld1q_u32(&length_array[curr])));
+    vlength = vaddq_u32(vlength, vdupq_n_u32(4));
+  }
+  for (; curr <= len; curr++) {
+    float x = price2 + litlentable[curr];
+    if (x < costs[curr]){
+      costs[curr] = x;
+      length_array[curr] = curr + dist;
     }
-    counter = costcontext->d_symbols[29] + 13;
-    for (; i < 32768; i++){
-      disttable[i] = counter;
+  }
+}
+
+/* Same for the integer costs of GetBestLengthsultra2, 8 at a time. */
+static ZOPFLI_INLINE void RelaxRangeIntNEON(unsigned price2, const unsigned char* litlentable, unsigned* costs,
+                                            unsigned* length_array, unsigned len, unsigned dist) {
+  unsigned curr = ZOPFLI_MIN_MATCH;
+  uint32x4_t vprice = vdupq_n_u32(price2);
+  uint32x4_t vlength = vaddq_u32(vdupq_n_u32(curr + dist), vld1q_u32(relax_steps));
+  for (; curr + 7 <= len; curr += 8) {
+    uint16x8_t lit = vmovl_u8(vld1_u8(&litlentable[curr]));
+    uint32x4_t x_low = vaddw_u16(vprice, vget_low_u16(lit));
+    uint32x4_t x_high = vaddw_u16(vprice, vget_high_u16(lit));
+    uint32x4_t cost_low = vld1q_u32(&costs[curr]);
+    uint32x4_t cost_high = vld1q_u32(&costs[curr + 4]);
+    uint32x4_t length_high = vaddq_u32(vlength, vdupq_n_u32(4));
+    vst1q_u32(&costs[curr], vminq_u32(x_low, cost_low));
+    vst1q_u32(&costs[curr + 4], vminq_u32(x_high, cost_high));
+    vst1q_u32(&length_array[curr], vbslq_u32(vcltq_u32(x_low, cost_low), vlength, vld1q_u32(&length_array[curr])));
+    vst1q_u32(&length_array[curr + 4], vbslq_u32(vcltq_u32(x_high, cost_high), length_high, vld1q_u32(&length_array[curr + 4])));
+    vlength = vaddq_u32(vlength, vdupq_n_u32(8));
+  }
+  for (; curr <= len; curr++) {
+    unsigned x = price2 + litlentable[curr];
+    if (x < costs[curr]){
+      costs[curr] = x;
+      length_array[curr] = curr + dist;
     }
+  }
+}
+#endif
+
+typedef void RelaxFunc(const unsigned char* in, size_t instart, size_t inend,
+                       const SymbolStats* costcontext, const float* litlentable, const float* disttable,
+                       float* costs, unsigned* length_array, LZCache* c);
+
+#define RELAX_NAME RelaxGeneric
+#define RELAX_ISA ZOPFLI_CPU_GENERIC
+#define RELAX_TARGET
+#include "squeeze_relax.h"
+
+#ifdef ZOPFLI_X86
+#define RELAX_NAME RelaxSSE2
+#define RELAX_ISA ZOPFLI_CPU_SSE2
+#define RELAX_TARGET ZOPFLI_TARGET("sse2")
+#include "squeeze_relax.h"
+
+#define RELAX_NAME RelaxSSE4_2
+#define RELAX_ISA ZOPFLI_CPU_SSE4_2
+#define RELAX_TARGET ZOPFLI_TARGET("sse4.2")
+#include "squeeze_relax.h"
+
+#define RELAX_NAME RelaxAVX
+#define RELAX_ISA ZOPFLI_CPU_AVX
+#define RELAX_TARGET ZOPFLI_TARGET("avx")
+#include "squeeze_relax.h"
+
+#define RELAX_NAME RelaxAVX2
+#define RELAX_ISA ZOPFLI_CPU_AVX2
+#define RELAX_TARGET ZOPFLI_TARGET("avx2")
+#include "squeeze_relax.h"
+
+#define RELAX_NAME RelaxAVX512
+#define RELAX_ISA ZOPFLI_CPU_AVX512
+#define RELAX_TARGET ZOPFLI_TARGET("avx512f")
+#include "squeeze_relax.h"
+#endif
+
+static RelaxFunc* GetRelaxKernel(void) {
+#ifdef ZOPFLI_X86
+  static RelaxFunc* const kernels[] = {RelaxGeneric, RelaxSSE2, RelaxSSE4_2, RelaxAVX, RelaxAVX2, RelaxAVX512};
+  if (zopfli_cpu > 0) return kernels[zopfli_cpu];
+#endif
+  return RelaxGeneric;
+}
+
+/*
+Fixed-point costs, in 1 / (1 << COST16_SHIFT) bits. With symbol costs clamped
+to 15 bits, reached positions within ZOPFLI_MAX_MATCH of each other differ by
+less than 258 literals of 15 bits, and positions not reached yet are set
+COST16_FAR above the position they are first seen from, so every compare is
+decided by the sign of the 16-bit difference.
+*/
+#define COST16_SHIFT 2
+#define COST16_FAR 16384
+
+typedef void Relax16Func(const unsigned char* in, size_t instart, size_t inend,
+                         const unsigned short* literals, const unsigned short* litlentable,
+                         const unsigned short* disttable,
+                         unsigned short* costs, unsigned* length_array, LZCache* c);
+
+#define RELAX_NAME Relax16Generic
+#define RELAX_ISA ZOPFLI_CPU_GENERIC
+#define RELAX_TARGET
+#include "squeeze_relax16.h"
+
+#ifdef ZOPFLI_X86
+#define RELAX_NAME Relax16SSE2
+#define RELAX_ISA ZOPFLI_CPU_SSE2
+#define RELAX_TARGET ZOPFLI_TARGET("sse2")
+#include "squeeze_relax16.h"
+
+#define RELAX_NAME Relax16AVX2
+#define RELAX_ISA ZOPFLI_CPU_AVX2
+#define RELAX_TARGET ZOPFLI_TARGET("avx2")
+#include "squeeze_relax16.h"
+#endif
+
+static Relax16Func* GetRelax16Kernel(void) {
+#ifdef ZOPFLI_X86
+  if (zopfli_cpu >= ZOPFLI_CPU_AVX2) return Relax16AVX2;
+  if (zopfli_cpu >= ZOPFLI_CPU_SSE2) return Relax16SSE2;
+#endif
+  return Relax16Generic;
+}
+
+/*
+Bits of every match length and distance under one cost model, extra bits
+included. The tables of the last model are kept per thread and reused while the
+model stays the same, as with fixed blocks, a reused cost model or converged
+iterations.
+*/
+typedef struct CostTables {
+  int valid;
+  /* The model the tables were built from: length and distance symbol costs. */
+  float len_symbols[29];
+  float d_symbols[30];
+  float litlentable[259];
+  float disttable[ZOPFLI_WINDOW_SIZE];
+} CostTables;
+
+/* Same for the integer costs of GetBestLengthsultra2. */
+typedef struct iCostTables {
+  int valid;
+  unsigned char len_symbols[29];
+  unsigned char d_symbols[30];
+  unsigned char litlentable[259 + 15]; /* padded for RelaxRangeIntAVX512 */
+  unsigned char disttable[ZOPFLI_WINDOW_SIZE];
+} iCostTables;
+
+static ZOPFLI_TLS CostTables costtables;
+static ZOPFLI_TLS iCostTables icosttables;
+
+/* Same on fixed-point costs. Also holds the literal costs. */
+typedef struct CostTables16 {
+  int valid;
+  float ll_symbols[288];
+  float d_symbols[30];
+  unsigned short literals[256];
+  unsigned short litlentable[259 + 15]; /* padded for the vector loops */
+  unsigned short disttable[ZOPFLI_WINDOW_SIZE];
+} CostTables16;
+
+static ZOPFLI_TLS CostTables16 costtables16;
+
+/* Smallest distance with distance symbol ds. */
+static unsigned DistSymbolStart(unsigned ds) {
+  if (ds < 4) return ds + 1;
+  return 1 + ((2 + (ds & 1)) << ((ds - 2) / 2));
+}
+
+static unsigned DistSymbolExtraBits(unsigned ds) {
+  return ds < 4 ? 0 : (ds - 2) / 2;
+}
+
+/*
+The distances of a symbol share one cost, so the table is filled run by run.
+cost is an expression of the distance symbol ds.
+*/
+#define FILL_DISTTABLE(disttable, cost) \
+  for (unsigned ds = 0; ds < 30; ds++) { \
+    unsigned end = DistSymbolStart(ds + 1); \
+    if (end > ZOPFLI_WINDOW_SIZE) end = ZOPFLI_WINDOW_SIZE; \
+    for (unsigned i = DistSymbolStart(ds); i < end; i++) { \
+      disttable[i] = cost; \
+    } \
+  }
+
+/* Returns the tables for the given symbol costs, valid until the next call. */
+static const CostTables* GetCostTables(const float* ll_symbols, const float* d_symbols) {
+  CostTables* t = &costtables;
+  if (t->valid && !memcmp(t->len_symbols, ll_symbols + 257, sizeof(t->len_symbols)) &&
+      !memcmp(t->d_symbols, d_symbols, sizeof(t->d_symbols))) {
+    return t;
+  }
+  t->valid = 1;
+  memcpy(t->len_symbols, ll_symbols + 257, sizeof(t->len_symbols));
+  memcpy(t->d_symbols, d_symbols, sizeof(t->d_symbols));
+  for (unsigned i = 3; i < 259; i++){
+    t->litlentable[i] = ll_symbols[ZopfliGetLengthSymbol(i)] + ZopfliGetLengthExtraBits(i);
+  }
+  FILL_DISTTABLE(t->disttable, d_symbols[ds] + DistSymbolExtraBits(ds));
+  return t;
+}
+
+static const iCostTables* GetCostTablesInt(const unsigned char* ll_symbols, const unsigned char* d_symbols) {
+  iCostTables* t = &icosttables;
+  if (t->valid && !memcmp(t->len_symbols, ll_symbols + 257, sizeof(t->len_symbols)) &&
+      !memcmp(t->d_symbols, d_symbols, sizeof(t->d_symbols))) {
+    return t;
+  }
+  t->valid = 1;
+  memcpy(t->len_symbols, ll_symbols + 257, sizeof(t->len_symbols));
+  memcpy(t->d_symbols, d_symbols, sizeof(t->d_symbols));
+  for (unsigned i = 3; i < 259; i++){
+    t->litlentable[i] = ll_symbols[ZopfliGetLengthSymbol(i)] + ZopfliGetLengthExtraBits(i);
+  }
+  memset(t->litlentable + 259, 0, 15);
+  FILL_DISTTABLE(t->disttable, d_symbols[ds] + DistSymbolExtraBits(ds));
+  return t;
+}
+
+/* Symbol cost in fixed point, clamped to [0, 15] bits. */
+static unsigned short Cost16(float bits) {
+  if (bits > 15) bits = 15;
+  if (bits < 0) bits = 0;
+  return (unsigned short)(bits * (1 << COST16_SHIFT) + 0.5f);
+}
+
+static const CostTables16* GetCostTables16(const SymbolStats* stats) {
+  CostTables16* t = &costtables16;
+  if (t->valid && !memcmp(t->ll_symbols, stats->ll_symbols, sizeof(t->ll_symbols)) &&
+      !memcmp(t->d_symbols, stats->d_symbols, sizeof(t->d_symbols))) {
+    return t;
+  }
+  t->valid = 1;
+  memcpy(t->ll_symbols, stats->ll_symbols, sizeof(t->ll_symbols));
+  memcpy(t->d_symbols, stats->d_symbols, sizeof(t->d_symbols));
+  for (unsigned i = 0; i < 256; i++){
+    t->literals[i] = Cost16(stats->ll_symbols[i]);
+  }
+  for (unsigned i = 3; i < 259; i++){
+    t->litlentable[i] = Cost16(stats->ll_symbols[ZopfliGetLengthSymbol(i)]) + (ZopfliGetLengthExtraBits(i) << COST16_SHIFT);
+  }
+  memset(t->litlentable + 259, 0, 15 * sizeof(t->litlentable[0]));
+  const float* d_symbols = stats->d_symbols;
+  FILL_DISTTABLE(t->disttable, Cost16(d_symbols[ds]) + (DistSymbolExtraBits(ds) << COST16_SHIFT));
+  return t;
+}
+
+#undef FILL_DISTTABLE
+
+/* Relaxes the whole block, iterations change nearly every symbol cost. */
+static void GetBestLengths2(const unsigned char* in, size_t instart, size_t inend,
+                           SymbolStats* costcontext, unsigned* length_array, LZCache* c) {
+  const CostTables* tables = GetCostTables(costcontext->ll_symbols, costcontext->d_symbols);
 
   size_t blocksize = inend - instart;
 
@@ -314,244 +560,204 @@ static void GetBestLengths2(const unsigned char* in, size_t instart, size_t inen
   if (!costs) exit(1); /* Allocation failed. */
   costs[0] = 0;  /* Because it's the start. */
   memset(costs + 1, 127, sizeof(float) * blocksize);
-  //Special handling for files with high redundancy
-#define RLE 1
-#define ML_MATCH 2
-#define ML_RLE 3
-  unsigned match_type = 0;
+  GetRelaxKernel()(in, instart, inend, costcontext, tables->litlentable, tables->disttable, costs, length_array, c);
 
-  for (i = instart; i < inend; i++) {
-    size_t j = i - instart;  /* Index in the costs array and length_array. */
+  c->pointer = 0;
 
-    if (match_type == ML_RLE) {
-      /* If we're in a long repetition of the same character and have more than
-       ZOPFLI_MAX_MATCH characters after our position. */
+  free(costs);
+}
+
+/* GetBestLengths2 with fixed-point costs. */
+static void GetBestLengths16(const unsigned char* in, size_t instart, size_t inend,
+                             const SymbolStats* costcontext, unsigned* length_array, LZCache* c) {
+  const CostTables16* tables = GetCostTables16(costcontext);
+
+  size_t blocksize = inend - instart;
+
+  unsigned short* costs = (unsigned short*)malloc(sizeof(unsigned short) * (blocksize + 1 + 15));
+  if (!costs) exit(1); /* Allocation failed. */
+  costs[0] = 0;  /* Because it's the start. */
+  GetRelax16Kernel()(in, instart, inend, tables->literals, tables->litlentable, tables->disttable, costs, length_array, c);
+
+  c->pointer = 0;
+
+  free(costs);
+}
+
+/*
+Matches of a whole master block in twice mode, found once and shared by all
+passes and blocks over it. Like LZCache, each position holds its number of
+values followed by its (length, distance) pairs, but lengths are not cut
+at any block end and positions in long runs, which GetBestLengths skips, hold
+their (ZOPFLI_MAX_MATCH, 1) pair. offsets holds where every
+MATCHCACHE_STRIDE-th position starts.
+*/
+#define MATCHCACHE_STRIDE 4096
+
+typedef struct MatchCache {
+  const unsigned char* in;  /* 0 when there is no cache. */
+  size_t instart;
+  size_t inend;
+  unsigned short* cache;
+  size_t size;
+  size_t* offsets;
+} MatchCache;
+
+static ZOPFLI_TLS MatchCache matchcache;
+
+void ZopfliBeginMatchCache(const ZopfliOptions* options, const unsigned char* in, size_t instart, size_t inend) {
+  MatchCache* m = &matchcache;
+  m->in = 0;
+  if (!options->useCache || options->numiterations == 1 || instart >= inend) return;
+
+  size_t blocksize = inend - instart;
+  m->size = blocksize * 3 + 513;
+  m->cache = (unsigned short*)malloc(m->size * sizeof(unsigned short));
+  m->offsets = (size_t*)malloc((blocksize / MATCHCACHE_STRIDE + 1) * sizeof(size_t));
+  if (!m->cache || !m->offsets) exit(1); /* Allocation failed. */
+
+  size_t windowstart = instart > ZOPFLI_WINDOW_SIZE ? instart - ZOPFLI_WINDOW_SIZE : 0;
+  CMatchFinder p;
+  p.hash = 0;
+  p.buffer = &in[windowstart];
+  p.bufend = &in[inend];
+  MatchFinder_Create(&p, MatchFinder_HashLog(inend - windowstart));
+  Bt3Zip_MatchFinder_Skip(&p, instart - windowstart);
+
+  size_t pointer = 0;
+  unsigned rle = 0;  /* Whether the last position only had (ZOPFLI_MAX_MATCH, 1). */
+  for (size_t i = instart; i < inend; i++) {
+    if (rle) {
       const unsigned char* match_end = GetMatch(&in[i], &in[i - 1], &in[inend], &in[inend] - 8);
       if (match_end >= &in[i] + ZOPFLI_MAX_MATCH) {
         unsigned match = match_end - &in[i] - ZOPFLI_MAX_MATCH + 1;
-
-        float symbolcost = costcontext->ll_symbols[285] + costcontext->d_symbols[0];
-        /* Set the length to reach each one to ZOPFLI_MAX_MATCH, and the cost to
-         the cost corresponding to that length. Doing this, we skip
-         ZOPFLI_MAX_MATCH values to avoid calling ZopfliFindLongestMatch. */
-        for (unsigned k = 0; k < match; k++) {
-          costs[j + ZOPFLI_MAX_MATCH] = costs[j] + symbolcost;
-          length_array[j + ZOPFLI_MAX_MATCH] = ZOPFLI_MAX_MATCH + (1 << 9);
-          j++;
+        for (unsigned k = 0; k < match; k++, i++) {
+          if ((i - instart) % MATCHCACHE_STRIDE == 0) m->offsets[(i - instart) / MATCHCACHE_STRIDE] = pointer;
+          if (m->size < pointer + 3) {
+            m->size *= 2;
+            m->cache = realloc(m->cache, m->size * sizeof(unsigned short));
+            if (!m->cache) exit(1);
+          }
+          m->cache[pointer++] = 2;
+          m->cache[pointer++] = ZOPFLI_MAX_MATCH;
+          m->cache[pointer++] = 1;
+        }
+        if (match > 32768) {
+          p.buffer = &in[i - 1];
+          memset(p.hash, 0, (p.hashMask + 1) * sizeof(unsigned));
+          p.cyclicBufferPos = 0;
+          p.pos = ZOPFLI_WINDOW_SIZE;
+          Bt3Zip_MatchFinder_Skip(&p, 1);
+        }
+        else {
+          Bt3Zip_MatchFinder_Skip2(&p, match);
         }
-
-        i += match;
       }
-      match_type = 0;
     }
 
-    unsigned short* matches = c->cache + c->pointer;
-    int numPairs = *matches;
-    matches++;
-    c->pointer += numPairs + 1;
+    if ((i - instart) % MATCHCACHE_STRIDE == 0) m->offsets[(i - instart) / MATCHCACHE_STRIDE] = pointer;
+    if (m->size < pointer + (ZOPFLI_MAX_MATCH - ZOPFLI_MIN_MATCH + 1) * 2 + 1) {
+      m->size *= 2;
+      m->cache = realloc(m->cache, m->size * sizeof(unsigned short));
+      if (!m->cache) exit(1);
+    }
+    unsigned short* matches = m->cache + pointer + 1;
+    unsigned short numPairs = Bt3Zip_MatchFinder_GetMatches(&p, matches);
+    m->cache[pointer] = numPairs;
+    pointer += numPairs + 1;
+    rle = numPairs == 2 && matches[0] == ZOPFLI_MAX_MATCH && matches[1] == 1;
+  }
+  MatchFinder_Free(&p);
 
-    if (numPairs){
-      const unsigned short * mend = matches + numPairs;
+  m->in = in;
+  m->instart = instart;
+  m->inend = inend;
+}
 
-      if (matches[0] == ZOPFLI_MAX_MATCH) {
-        unsigned dist = matches[1];
-        if (dist == 1) {match_type = ML_RLE;}
+void ZopfliEndMatchCache(void) {
+  MatchCache* m = &matchcache;
+  if (!m->in) return;
+  free(m->cache);
+  free(m->offsets);
+  m->in = 0;
+}
 
-        costs[j + ZOPFLI_MAX_MATCH] = costs[j] + disttable[dist] + litlentable[ZOPFLI_MAX_MATCH];
-        length_array[j + ZOPFLI_MAX_MATCH] = ZOPFLI_MAX_MATCH + (dist << 9);
+/*
+If the master block match cache covers in[instart, inend), fills c with its
+matches cut at inend and laid out as GetBestLengths stores them, and returns 1.
+*/
+static int MatchCacheSlice(const unsigned char* in, size_t instart, size_t inend, LZCache* c) {
+  const MatchCache* m = &matchcache;
+  if (!m->in || m->in != in || instart < m->instart || inend > m->inend || instart >= inend) return 0;
 
-      }
-#if 0 //More speed, less compression.
-      else if (*(mend - 2) == ZOPFLI_MAX_MATCH){
-        unsigned dist = matches[numPairs - 1];
-        costs[j + ZOPFLI_MAX_MATCH] = costs[j] + disttable[dist] + litlentable[ZOPFLI_MAX_MATCH];
-        length_array[j + ZOPFLI_MAX_MATCH] = ZOPFLI_MAX_MATCH + (dist << 9);
-      }
-#endif
-      else{
-        float price = costs[j];
-        unsigned short* mp = matches;
+  size_t i = instart - (instart - m->instart) % MATCHCACHE_STRIDE;
+  size_t pointer = m->offsets[(i - m->instart) / MATCHCACHE_STRIDE];
+  for (; i < instart; i++) pointer += m->cache[pointer] + 1;
 
-        unsigned curr = ZOPFLI_MIN_MATCH;
-        while (mp < mend){
-          unsigned len = *mp++;
-          unsigned dist = *mp++;
-          float price2 = price + disttable[dist];
-          dist <<=9;
-#if defined(__AVX__)
-          for (; curr + 8 < len; curr+=8) {
-            __m256 x8 = _mm256_add_ps(_mm256_set1_ps(price2), _mm256_loadu_ps(&litlentable[curr]));
-            __m256 vcost = _mm256_loadu_ps(&costs[j + curr]);
-            _mm256_storeu_ps(&costs[j + curr], _mm256_min_ps(x8, vcost));
-#if defined(__AVX2__)
-            __m256i vlength = _mm256_add_epi32(_mm256_set1_epi32(curr + dist), _mm256_setr_epi32(0,1,2,3,4,5,6,7));
-            vlength = _mm256_blendv_epi8(_mm256_loadu_si256((__m256i*)&length_array[j + curr]), vlength, cmp_mask);
-#else
-            __m128i vlength_low = _mm_add_epi32(_mm_set1_epi32(curr + dist), _mm_setr_epi32(0, 1, 2, 3));
-            __m128i vlength_high = _mm_add_epi32(_mm_set1_epi32(curr + dist), _mm_setr_epi32(4, 5, 6, 7));
-            __m256i vlength = _mm256_set_m128i(vlength_high, vlength_low);
-            vlength = _mm256_castps_si256(_mm256_blendv_ps(_mm256_castsi256_ps(_mm256_loadu_si256((__m256i*)&length_array[j + curr])),
-                                                                               _mm256_castsi256_ps(vlength), _mm256_cmp_ps(x8, vcost, _CMP_LT_OQ)));
-#endif
-            _mm256_storeu_si256((__m256i*)&length_array[j + curr], vlength);
-          }
-#endif
-#if defined(ZOPFLI_HAVE_SSE2)
-          for (; curr + 4 < len; curr += 4) {
-            __m128 x4 = _mm_add_ps(_mm_set1_ps(price2), _mm_loadu_ps(&litlentable[curr]));
-            __m128 vcost = _mm_loadu_ps(&costs[j + curr]);
-            _mm_storeu_ps(&costs[j + curr], _mm_min_ps(x4, vcost));
-            __m128i vlength = _mm_add_epi32(_mm_set1_epi32(curr + dist), _mm_setr_epi32(0, 1, 2, 3));
-            __m128i cmp_mask = _mm_castps_si128(_mm_cmplt_ps(x4, vcost));
-#if defined(ZOPFLI_HAVE_SSE4_1)
-            vlength = _mm_blendv_epi8(_mm_loadu_si128((__m128i*)&length_array[j + curr]), vlength, cmp_mask);
-#else
-            vlength = _mm_or_si128(_mm_and_si128(vlength, cmp_mask), _mm_andnot_si128(cmp_mask, old_vlength));
-#endif
-            _mm_storeu_si128((__m128i*)&length_array[j + curr], vlength);
-          }
-#elif defined(__aarch64__) || defined(__arm__) || defined(_M_ARM64) || defined(_M_ARM)
-          for (; curr + 4 < len; curr += 4) {
-            float32x4_t x4 = vaddq_f32(vdupq_n_f32(price2), vld1q_f32(&litlentable[curr]));
-            float32x4_t vcost = vld1q_f32(&costs[j + curr]);
-            vst1q_f32(&costs[j + curr], vminq_f32(x4, vcost));
-            uint32x4_t vlength = vaddq_u32(vdupq_n_u32(curr + dist), (uint32x4_t){0, 1, 2, 3});
-            uint32x4_t cmp_mask = vcltq_f32(x4, vcost);
-            vlength = vbslq_u32(cmp_mask, vlength, vld1q_u32(&length_array[j + curr]));
-            vst1q_u32(&length_array[j + curr], vlength);
-          }
-#endif
-#ifdef __GNUC__
-#pragma GCC unroll 1 /* no unroll */
-#endif
-          for (; curr <= len; curr++) {
-            float x = price2 + litlentable[curr];
-            if (x < costs[j + curr]){
-              costs[j + curr] = x;
-              length_array[j + curr] = curr + dist;
-            }
-          }
-        }
+  CreateCache(inend - instart, c);
+  unsigned match_type = 0;
+  for (i = instart; i < inend; i++) {
+    /* Skip the positions GetBestLengths2 skips. */
+    if (match_type == ML_RLE) {
+      const unsigned char* match_end = GetMatch(&in[i], &in[i - 1], &in[inend], &in[inend] - 8);
+      if (match_end >= &in[i] + ZOPFLI_MAX_MATCH) {
+        unsigned match = match_end - &in[i] - ZOPFLI_MAX_MATCH + 1;
+        for (unsigned k = 0; k < match; k++) pointer += m->cache[pointer] + 1;
+        i += match;
       }
+      match_type = 0;
     }
 
-    /* Literal. */
-    float newCost = costs[j] + literals[in[i]];
-    if (newCost < costs[j + 1]) {
-      costs[j + 1] = newCost;
-      length_array[j + 1] = 1U + (in[i] << 24);
+    if (c->size < c->pointer + (ZOPFLI_MAX_MATCH - ZOPFLI_MIN_MATCH + 1) * 2 + 1) {
+      c->size *= 2;
+      c->cache = realloc(c->cache, c->size * sizeof(unsigned short));
+      if (!c->cache) exit(1);
+    }
+    const unsigned short* src = m->cache + pointer + 1;
+    unsigned short n = m->cache[pointer];
+    pointer += n + 1;
+    unsigned short* matches = c->cache + c->pointer + 1;
+    unsigned short k = 0;
+    size_t rem = inend - i;
+    if (rem >= ZOPFLI_MIN_MATCH) {
+      while (k < n) {
+        matches[k] = src[k] < rem ? src[k] : rem;
+        matches[k + 1] = src[k + 1];
+        k += 2;
+        if (src[k - 2] >= rem) break;
+      }
     }
+    c->cache[c->pointer] = k;
+    c->pointer += k + 1;
+    if (k && matches[0] == ZOPFLI_MAX_MATCH && matches[1] == 1) match_type = ML_RLE;
   }
-
   c->pointer = 0;
-
-  free(disttable);
-  free(costs);
+  return 1;
 }
 
 static void GetBestLengths(const ZopfliOptions* options, const unsigned char* in, size_t instart, size_t inend,
                            SymbolStats* costcontext, unsigned* length_array, unsigned char storeincache, LZCache* c, unsigned mfinexport) {
   size_t i;
 
-  /*TODO: Put this in separate function*/
-  float litlentable [259];
-  float* disttable = (float*)malloc(ZOPFLI_WINDOW_SIZE * sizeof(float));
-  float* literals;
-  if (!disttable){
-    exit(1);
-  }
+  const float* literals;
+  const CostTables* tables;
+  float fixed_ll[288];
+  float fixed_d[32] = {0};
   if (costcontext){  /* Dynamic Block */
-
     literals = costcontext->ll_symbols;
-    for (i = 3; i < 259; i++){
-      litlentable[i] = costcontext->ll_symbols[ZopfliGetLengthSymbol(i)] + ZopfliGetLengthExtraBits(i);
-    }
-    for (i = 1; i < 513; i++){
-      disttable[i] = costcontext->d_symbols[ZopfliGetDistSymbol(i)] + ZopfliGetDistExtraBits(i);
-    }
-    float counter = costcontext->d_symbols[18] + 8;
-    for (; i < 769; i++){
-      disttable[i] = counter;
-    }
-    counter = costcontext->d_symbols[19] + 8;
-    for (; i < 1025; i++){
-      disttable[i] = counter;
-    }
-    counter = costcontext->d_symbols[20] + 9;
-    for (; i < 1537; i++){
-      disttable[i] = counter;
-    }
-    counter = costcontext->d_symbols[21] + 9;
-    for (; i < 2049; i++){
-      disttable[i] = counter;
-    }
-    counter = costcontext->d_symbols[22] + 10;
-    for (; i < 3073; i++){
-      disttable[i] = counter;
-    }
-    counter = costcontext->d_symbols[23] + 10;
-    for (; i < 4097; i++){
-      disttable[i] = counter;
-    }
-    counter = costcontext->d_symbols[24] + 11;
-    for (; i < 6145; i++){
-      disttable[i] = counter;
-    }
-    counter = costcontext->d_symbols[25] + 11;
-    for (; i < 8193; i++){
-      disttable[i] = counter;
-    }
-    counter = costcontext->d_symbols[26] + 12;
-    for (; i < 12289; i++){
-      disttable[i] = counter;
-    }
-    counter = costcontext->d_symbols[27] + 12;
-    for (; i < 16385; i++){
-      disttable[i] = counter;
-    }
-    counter = costcontext->d_symbols[28] + 13;
-    for (; i < 24577; i++){
-      disttable[i] = counter;
-    }
-    counter = costcontext->d_symbols[29] + 13;
-    for (; i < 32768; i++){
-      disttable[i] = counter;
-    }
+    tables = GetCostTables(costcontext->ll_symbols, costcontext->d_symbols);
   }
   else {
-    literals = (float*)malloc(256 * sizeof(float));
-    if (!literals){
-      exit(1);
-    }
-
-    for (i = 0; i < 144; i++){
-      literals[i] = 8;
-    }
-    for (; i < 256; i++){
-      literals[i] = 9;
-    }
-    for (i = 3; i < 259; i++){
-      litlentable[i] = 12 + (i > 114) + ZopfliGetLengthExtraBits(i);
-    }
-    for (i = 1; i < 1025; i++){
-      disttable[i] = ZopfliGetDistExtraBits(i);
-    }
-    for (; i < 2049; i++){
-      disttable[i] = 9;
-    }
-    for (; i < 4097; i++){
-      disttable[i] = 10;
-    }
-    for (; i < 8193; i++){
-      disttable[i] = 11;
-    }
-    for (; i < 16385; i++){
-      disttable[i] = 12;
-    }
-    for (; i < 32768; i++){
-      disttable[i] = 13;
-    }
+    /* Fixed block. The 5 bits of the distance code count with the length. */
+    for (i = 0; i < 144; i++) fixed_ll[i] = 8;
+    for (; i < 256; i++) fixed_ll[i] = 9;
+    for (i = 257; i < 280; i++) fixed_ll[i] = 12;
+    for (; i < 288; i++) fixed_ll[i] = 13;
+    literals = fixed_ll;
+    tables = GetCostTables(fixed_ll, fixed_d);
   }
+  const float* litlentable = tables->litlentable;
+  const float* disttable = tables->disttable;
 
   size_t blocksize = inend - instart;
 
@@ -577,7 +783,7 @@ static void GetBestLengths(const ZopfliOptions* options, const unsigned char* in
       p.buffer = &in[windowstart];
       p.bufend = &in[inend];
 
-      MatchFinder_Create(&p);
+      MatchFinder_Create(&p, MatchFinder_HashLog(inend - windowstart));
       Bt3Zip_MatchFinder_Skip(&p, instart - windowstart);
     }
 
@@ -619,7 +825,7 @@ static void GetBestLengths(const ZopfliOptions* options, const unsigned char* in
           else{
             if (match > 32768) {
               p.buffer = &in[i + match - 1];
-              memset(p.hash, 0, LZFIND_HASH_SIZE * sizeof(unsigned));
+              memset(p.hash, 0, (p.hashMask + 1) * sizeof(unsigned));
               p.cyclicBufferPos = 0;
               p.pos = ZOPFLI_WINDOW_SIZE;
               Bt3Zip_MatchFinder_Skip(&p, 1);
@@ -695,6 +901,17 @@ static void GetBestLengths(const ZopfliOptions* options, const unsigned char* in
             curr = len + 1;
             continue;
           }
+#ifdef ZOPFLI_X86
+          if (zopfli_cpu >= ZOPFLI_CPU_AVX512) {
+            RelaxRangeAVX512(price2, litlentable, costs + j, length_array + j, curr, len, dist);
+            curr = len + 1;
+            continue;
+          }
+#elif defined(ZOPFLI_NEON)
+          RelaxRangeNEON(price2, litlentable, costs + j, length_array + j, curr, len, dist);
+          curr = len + 1;
+          continue;
+#endif
           for (; curr <= len; curr++) {
             float x = price2 + litlentable[curr];
             if (x < costs[j + curr]){
@@ -724,28 +941,16 @@ static void GetBestLengths(const ZopfliOptions* options, const unsigned char* in
     c->pointer = 0;
   }
 
-  if (!costcontext){
-    free(literals);
-  }
-  free(disttable);
   free(costs);
 }
 
 static void GetBestLengthsultra2(const unsigned char* in, size_t instart, size_t inend, iSymbolStats* costcontext, unsigned* length_array) {
   size_t i;
 
-  unsigned char litlentable [259];
-  unsigned char* disttable = (unsigned char*)malloc(ZOPFLI_WINDOW_SIZE);
-  if (!disttable){
-    exit(1);
-  }
-  unsigned char* literals = costcontext->ll_symbols;
-  for (i = 3; i < 259; i++){
-    litlentable[i] = costcontext->ll_symbols[ZopfliGetLengthSymbol(i)] + ZopfliGetLengthExtraBits(i);
-  }
-  for (i = 1; i < 32768; i++){
-    disttable[i] = costcontext->d_symbols[ZopfliGetDistSymbol(i)] + ZopfliGetDistExtraBits(i);
-  }
+  const iCostTables* tables = GetCostTablesInt(costcontext->ll_symbols, costcontext->d_symbols);
+  const unsigned char* litlentable = tables->litlentable;
+  const unsigned char* disttable = tables->disttable;
+  const unsigned char* literals = costcontext->ll_symbols;
 
   size_t blocksize = inend - instart;
 
@@ -775,6 +980,15 @@ static void GetBestLengthsultra2(const unsigned char* in, size_t instart, size_t
         unsigned len = *mp++;
         unsigned dist = *mp++;
         unsigned price2 = price + disttable[dist];
+#ifdef ZOPFLI_X86
+        if (zopfli_cpu >= ZOPFLI_CPU_AVX512) {
+          RelaxRangeIntAVX512(price2, litlentable, costs + j, length_array + j, len, dist << 9);
+          continue;
+        }
+#elif defined(ZOPFLI_NEON)
+        RelaxRangeIntNEON(price2, litlentable, costs + j, length_array + j, len, dist << 9);
+        continue;
+#endif
         for (unsigned curr = ZOPFLI_MIN_MATCH; curr <= len; curr++) {
           unsigned x = price2 + litlentable[curr];
           if (x < costs[j + curr]){
@@ -793,7 +1007,6 @@ static void GetBestLengthsultra2(const unsigned char* in, size_t instart, size_t
     }
   }
 
-  free(disttable);
   free(costs);
 }
 
@@ -946,7 +1159,12 @@ static void LZ77OptimalRun(const ZopfliOptions* options, const unsigned char* in
   }
   else{
     if(storeincache == 2){
-      GetBestLengths2(in, instart, inend, costcontext, length_array, c);
+      if (options->fixedcosts) {
+        GetBestLengths16(in, instart, inend, costcontext, length_array, c);
+      }
+      else {
+        GetBestLengths2(in, instart, inend, costcontext, length_array, c);
+      }
     }
     else{
         GetBestLengths(options, in, instart, inend, costcontext, length_array, storeincache, c, mfinexport);
@@ -961,13 +1179,70 @@ static void LZ77OptimalRun(const ZopfliOptions* options, const unsigned char* in
 }
 
 /*TODO: Replace this w/ proper implementation. This performs bad on files w/ changing redundancy */
-static SymbolStats st;
+static ZOPFLI_TLS SymbolStats st;
+
+/*
+With options->adaptive, iterations move between the blocks of a stream by
+what the first two iterations show:
+- blocks whose first iteration costs more than ADAPTIVE_DENSE_BITS bits per
+  byte get at most ADAPTIVE_DENSE_ITERATIONS iterations and no ultra passes;
+- blocks whose second iteration gained less than ADAPTIVE_SETTLED_GAIN of the
+  cost get half their iterations, later ones rarely find more;
+- blocks whose second iteration gained nothing are stuck until randomization
+  kicks in and get up to twice their iterations;
+- blocks still gaining fast keep theirs.
+The extra iterations are paid from those given up earlier in the stream,
+counted in bytes times iterations, so the total work never grows.
+*/
+#define ADAPTIVE_DENSE_BITS 6
+#define ADAPTIVE_DENSE_ITERATIONS 3
+#define ADAPTIVE_SETTLED_GAIN 0.01
+static ZOPFLI_TLS size_t adaptive_bank;
+
+/* Iterations run and left out since the last ZopfliResetSqueeze. */
+static ZOPFLI_TLS size_t stats_iterations;
+static ZOPFLI_TLS size_t stats_iterationsskipped;
+
+/*
+With options->convergence, iterating stops once the best cost improved by at
+most this fraction over that many iterations. Windows are capped below
+CONVERGENCE_HISTORY.
+*/
+#define CONVERGENCE_THRESHOLD 1e-4
+#define CONVERGENCE_HISTORY 64
+
+/* Gives up or draws iterations after the second one, see ADAPTIVE_DENSE_BITS. */
+static void AdaptIterations(double firstcost, double cost, size_t blocksize, int* numiterations, unsigned* ultra) {
+  int target = *numiterations;
+  if (firstcost > ADAPTIVE_DENSE_BITS * blocksize) {
+    /* Nearly incompressible, further iterations find next to nothing. */
+    if (target > ADAPTIVE_DENSE_ITERATIONS) target = ADAPTIVE_DENSE_ITERATIONS;
+    *ultra = 0;
+  }
+  else if (cost < firstcost) {
+    if (cost <= (1 - ADAPTIVE_SETTLED_GAIN) * firstcost) return;  /* Still gaining fast. */
+    target = (target + 1) / 2;
+    if (target < ADAPTIVE_DENSE_ITERATIONS) target = ADAPTIVE_DENSE_ITERATIONS;
+  }
+  else {
+    /* Stuck until randomization kicks in. */
+    size_t extra = adaptive_bank / blocksize;
+    if (extra > (size_t)*numiterations) extra = *numiterations;
+    adaptive_bank -= extra * blocksize;
+    *numiterations += extra;
+    return;
+  }
+  if (target < *numiterations) {
+    adaptive_bank += (size_t)(*numiterations - target) * blocksize;
+    *numiterations = target;
+  }
+}
 
 static void ZopfliLZ77Optimal(const ZopfliOptions* options,
                        const unsigned char* in, size_t instart, size_t inend,
                        ZopfliLZ77Store* store, unsigned char first, SymbolStats* statsp, unsigned mfinexport) {
-  /* Dist to get to here with smallest cost. */
-  unsigned* length_array = (unsigned*)malloc(sizeof(unsigned) * (inend - instart + 1));
+  /* Dist to get to here with smallest cost. Padded for GetBestLengths16. */
+  unsigned* length_array = (unsigned*)malloc(sizeof(unsigned) * (inend - instart + 1 + 15));
   ZopfliLZ77Store currentstore;
   SymbolStats stats, beststats, laststats;
   double cost;
@@ -1045,17 +1320,36 @@ static void ZopfliLZ77Optimal(const ZopfliOptions* options,
 
   LZCache c;
   int stinit = 0;
+  /* With the master block's matches, the first run already uses the cache. */
+  unsigned char firstcache = 1;
   if (options->useCache){
-    CreateCache(inend - instart, &c);
+    if (MatchCacheSlice(in, instart, inend, &c)) {
+      firstcache = 2;
+      /* This block does not pass on a match finder, so the next one must not
+      pick up an older one. */
+      if (right) {
+        MatchFinder_Free(&mf);
+        right = 0;
+      }
+    }
+    else {
+      CreateCache(inend - instart, &c);
+    }
   }
   /* Repeat statistics with each time the cost model from the previous stat
   run. */
-  for (int i = 1; i < options->numiterations + 1; i++) {
+  int numiterations = options->numiterations;
+  unsigned ultra = options->ultra;
+  double history[CONVERGENCE_HISTORY];  /* Best cost after each iteration. */
+  unsigned converged = 0;
+  double firstcost = 0;
+  unsigned window = options->convergence < CONVERGENCE_HISTORY ? options->convergence : CONVERGENCE_HISTORY - 1;
+  for (int i = 1; i < numiterations + 1; i++) {
     ZopfliCleanLZ77Store(&currentstore);
     ZopfliInitLZ77Store(&currentstore);
 
     //TODO: This is very powerful and needs additional tuning.
-    if ((i == options->numiterations - 1 && options->numiterations > 5)|| (i == 9/* && !options->ultra*/) || i == 30){//TODO:Disabling this helps with high iters, also with enwik -6
+    if (converged || (i == numiterations - 1 && numiterations > 5)|| (i == 9/* && !options->ultra*/) || i == 30){//TODO:Disabling this helps with high iters, also with enwik -6
       unsigned bl[288];
 
       OptimizeHuffmanCountsForRle(32, beststats.dists);
@@ -1072,7 +1366,7 @@ static void ZopfliLZ77Optimal(const ZopfliOptions* options,
       }
     }
 
-    LZ77OptimalRun(options, in, instart, inend, length_array, &stats, &currentstore, options->useCache ? i == 1 ? 1 : 2 : 0, &c, mfinexport, 0);
+    LZ77OptimalRun(options, in, instart, inend, length_array, &stats, &currentstore, options->useCache ? i == 1 ? firstcache : 2 : 0, &c, mfinexport, 0);
 
     unsigned gui = 0;
     cost = ZopfliCalculateBlockSize(currentstore.litlens, currentstore.dists, 0, currentstore.size, 2, options->searchext, currentstore.symbols);
@@ -1106,10 +1400,21 @@ static void ZopfliLZ77Optimal(const ZopfliOptions* options,
       lastrandomstep = i;
     }
     lastcost = cost;
-    if(gui && options->numiterations < 6){break;}
+    if (i == 1) firstcost = cost;
+    if (i == 2 && options->adaptive) AdaptIterations(firstcost, bestcost, inend - instart, &numiterations, &ultra);
+    history[i % CONVERGENCE_HISTORY] = bestcost;
+    if (options->convergence && i > (int)window && numiterations > i + 1
+        && history[(i - window) % CONVERGENCE_HISTORY] - bestcost <= bestcost * CONVERGENCE_THRESHOLD) {
+      /* Converged. One last iteration with the lengths of the best run as costs. */
+      stats_iterationsskipped += numiterations - i - 1;
+      numiterations = i + 1;
+      converged = 1;
+    }
+    stats_iterations++;
+    if(gui && numiterations < 6){break;}
   }
 
-  if (options->ultra){
+  if (ultra){
     unsigned bl[288];
     unsigned bld[32];
 
@@ -1145,7 +1450,11 @@ static void ZopfliLZ77Optimal(const ZopfliOptions* options,
       else{
         ZopfliCleanLZ77Store(&peace);
 
-        if (options->ultra >= 2){
+        if (ultra >= 2){
+          iSymbolStats ista;
+          iSymbolStats lastista;
+          memset(&ista, 0, sizeof(ista));
+          memset(&lastista, 0, sizeof(lastista));
 
           for(;;){
 
@@ -1160,13 +1469,15 @@ static void ZopfliLZ77Optimal(const ZopfliOptions* options,
             ZopfliLengthLimitedCodeLengths(sta.litlens, 288, 15, bl);
 
             ZopfliLengthLimitedCodeLengths(sta.dists, 32, 15, bld);
-            iSymbolStats ista;
             for (int j = 0; j < 286; j++){
               ista.ll_symbols[j] = bl[j];
             }
             for (int j = 0; j < 30; j++){
               ista.d_symbols[j] = bld[j];
             }
+            /* The same lengths would find the same path, which is no better. */
+            if (!memcmp(&ista, &lastista, sizeof(ista))) break;
+            lastista = ista;
             LZ77OptimalRun(options, in, instart, inend, length_array, &ista, &peace, 0, &c, mfinexport, 1);
             newcost = ZopfliCalculateBlockSize(peace.litlens, peace.dists, 0, peace.size, 2, options->searchext, peace.symbols);
             if (newcost < bestcost){
@@ -1178,7 +1489,7 @@ static void ZopfliLZ77Optimal(const ZopfliOptions* options,
               ZopfliCleanLZ77Store(&peace);
               break;
             }
-            if (options->ultra != 3) {
+            if (ultra != 3) {
               break;
             }
           }
@@ -1195,12 +1506,104 @@ static void ZopfliLZ77Optimal(const ZopfliOptions* options,
     CleanCache(&c);
   }
   free(length_array);
-  if (options->reuse_costmodel && !stinit){
+  if (!stinit){
     CopyStats(&beststats, &st);
   }
   ZopfliCleanLZ77Store(&currentstore);
 }
 
+void ZopfliResetSqueeze(void) {
+  memset(&st, 0, sizeof(st));
+  adaptive_bank = 0;
+  stats_iterations = 0;
+  stats_iterationsskipped = 0;
+  if (right) {
+    MatchFinder_Free(&mf);
+    right = 0;
+  }
+}
+
+void ZopfliSetCostModel(const ZopfliCostModel* model) {
+  for (unsigned i = 0; i < 288; i++) {
+    st.litlens[i] = model->litlens[i];
+    st.ll_symbols[i] = model->ll_symbols[i];
+  }
+  for (unsigned i = 0; i < 32; i++) {
+    st.dists[i] = model->dists[i];
+    st.d_symbols[i] = model->d_symbols[i];
+  }
+}
+
+void ZopfliAddIterationStats(ZopfliStats* stats) {
+  stats->iterations += stats_iterations;
+  stats->iterationsskipped += stats_iterationsskipped;
+}
+
+void ZopfliGetCostModel(ZopfliCostModel* model) {
+  for (unsigned i = 0; i < 288; i++) {
+    model->litlens[i] = st.litlens[i] > UINT_MAX ? UINT_MAX : st.litlens[i];
+    model->ll_symbols[i] = st.ll_symbols[i];
+  }
+  for (unsigned i = 0; i < 32; i++) {
+    model->dists[i] = st.dists[i] > UINT_MAX ? UINT_MAX : st.dists[i];
+    model->d_symbols[i] = st.d_symbols[i];
+  }
+}
+
+static void StoreU32(unsigned v, unsigned char* out) {
+  out[0] = v % 256;
+  out[1] = (v >> 8) % 256;
+  out[2] = (v >> 16) % 256;
+  out[3] = v >> 24;
+}
+
+static unsigned LoadU32(const unsigned char* in) {
+  return in[0] | (in[1] << 8) | (in[2] << 16) | ((unsigned)in[3] << 24);
+}
+
+static unsigned FloatBits(float f) {
+  unsigned v;
+  memcpy(&v, &f, 4);
+  return v;
+}
+
+static float BitsFloat(unsigned v) {
+  float f;
+  memcpy(&f, &v, 4);
+  return f;
+}
+
+/* "ZCM" followed by the format version. */
+static const unsigned char costmodel_magic[4] = {'Z', 'C', 'M', 1};
+
+void ZopfliSaveCostModel(const ZopfliCostModel* model, unsigned char* out) {
+  memcpy(out, costmodel_magic, 4);
+  out += 4;
+  for (unsigned i = 0; i < 288; i++, out += 4) StoreU32(model->litlens[i], out);
+  for (unsigned i = 0; i < 32; i++, out += 4) StoreU32(model->dists[i], out);
+  for (unsigned i = 0; i < 288; i++, out += 4) StoreU32(FloatBits(model->ll_symbols[i]), out);
+  for (unsigned i = 0; i < 32; i++, out += 4) StoreU32(FloatBits(model->d_symbols[i]), out);
+}
+
+int ZopfliLoadCostModel(ZopfliCostModel* model, const unsigned char* in, size_t insize) {
+  if (insize != ZOPFLI_COSTMODEL_SIZE || memcmp(in, costmodel_magic, 4)) {
+    return 0;
+  }
+  in += 4;
+  for (unsigned i = 0; i < 288; i++, in += 4) model->litlens[i] = LoadU32(in);
+  for (unsigned i = 0; i < 32; i++, in += 4) model->dists[i] = LoadU32(in);
+  for (unsigned i = 0; i < 288; i++, in += 4) model->ll_symbols[i] = BitsFloat(LoadU32(in));
+  for (unsigned i = 0; i < 32; i++, in += 4) model->d_symbols[i] = BitsFloat(LoadU32(in));
+  /* Reject NaN and infinite costs, they would break the shortest path search. */
+  for (unsigned i = 0; i < 288; i++) {
+    if (!(model->ll_symbols[i] >= 0 && model->ll_symbols[i] < ZOPFLI_LARGE_FLOAT)) return 0;
+  }
+  for (unsigned i = 0; i < 32; i++) {
+    if (!(model->d_symbols[i] >= 0 && model->d_symbols[i] < ZOPFLI_LARGE_FLOAT)) return 0;
+  }
+  return 1;
+}
+
 void ZopfliLZ77Optimal2(const ZopfliOptions* options,
                         const unsigned char* in, size_t instart, size_t inend,
                         ZopfliLZ77Store* store, unsigned char costmodelnotinited, SymbolStats* statsp, unsigned mfinexport) {
@@ -1266,6 +1669,9 @@ void ZopfliLZ77Optimal2(const ZopfliOptions* options,
     if (!costmodelnotinited){
       MixCostmodels(&st, &stats, .2);
     }
+    else if (options->reuse_costmodel){
+      CopyStats(&stats, &st);
+    }
   }
   else{
     SymbolStats fromBlocksplitting = *statsp;
@@ -1273,8 +1679,8 @@ void ZopfliLZ77Optimal2(const ZopfliOptions* options,
   }
 
   ZopfliInitLZ77Store(store);
-  /* Dist to get to here with smallest cost. */
-  unsigned* length_array = (unsigned*)malloc(sizeof(unsigned) * (inend - instart + 1));
+  /* Dist to get to here with smallest cost. Padded for GetBestLengths16. */
+  unsigned* length_array = (unsigned*)malloc(sizeof(unsigned) * (inend - instart + 1 + 15));
   if (!length_array) exit(1); /* Allocation failed. */
   LZ77OptimalRun(options, in, instart, inend, length_array, options->reuse_costmodel ? &st : &stats, store, 0, 0, mfinexport, 0);
   free(length_array);
@@ -1287,8 +1693,8 @@ void ZopfliLZ77OptimalFixed(const ZopfliOptions* options,
                             size_t instart, size_t inend,
                             ZopfliLZ77Store* store, unsigned mfinexport)
 {
-  /* Dist to get to here with smallest cost. */
-  unsigned* length_array = (unsigned*)malloc(sizeof(unsigned) * (inend - instart + 1));
+  /* Dist to get to here with smallest cost. Padded for GetBestLengths16. */
+  unsigned* length_array = (unsigned*)malloc(sizeof(unsigned) * (inend - instart + 1 + 15));
   if (!length_array) exit(1); /* Allocation failed. */
 
   /* Shortest path for fixed tree This one should give the shortest possible
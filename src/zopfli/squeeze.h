@@ -52,6 +52,32 @@ typedef struct SymbolStats {
 
 void GetStatistics(const ZopfliLZ77Store* store, SymbolStats* stats);
 
+/*
+Forgets the cost model, the match finder state and the iterations given up
+(see ZopfliOptions.adaptive) that earlier blocks of this thread left behind, so
+the output of a stream does not depend on them.
+*/
+void ZopfliResetSqueeze(void);
+
+/* Replaces the cost model that is reused across blocks. */
+void ZopfliSetCostModel(const ZopfliCostModel* model);
+
+/* Gets the cost model that is reused across blocks. */
+void ZopfliGetCostModel(ZopfliCostModel* model);
+
+/* Adds the iterations run and skipped since ZopfliResetSqueeze to stats. */
+void ZopfliAddIterationStats(ZopfliStats* stats);
+
+/*
+Finds the matches of in[instart, inend) once for all following optimal parses
+of blocks inside it, until ZopfliEndMatchCache. Does nothing unless the options
+cache matches over several iterations.
+*/
+void ZopfliBeginMatchCache(const ZopfliOptions* options, const unsigned char* in, size_t instart, size_t inend);
+
+/* Frees the matches found by ZopfliBeginMatchCache. */
+void ZopfliEndMatchCache(void);
+
 /*
 Calculates lit/len and dist pairs for given data.
 If instart is larger than 0, it uses values before instart as starting
@@ -0,0 +1,139 @@
+/*
+Main loop of GetBestLengths2, included by squeeze.c once per instruction set
+level. Before including, define RELAX_NAME to the function name, RELAX_ISA to
+one of the ZOPFLI_CPU_* levels and RELAX_TARGET to its target attribute.
+*/
+
+static RELAX_TARGET void RELAX_NAME(const unsigned char* in, size_t instart, size_t inend,
+                                    const SymbolStats* costcontext, const float* litlentable, const float* disttable,
+                                    float* costs, unsigned* length_array, LZCache* c) {
+  size_t i;
+  const float* literals = costcontext->ll_symbols;
+  //Special handling for files with high redundancy
+  unsigned match_type = 0;
+
+  for (i = instart; i < inend; i++) {
+    size_t j = i - instart;  /* Index in the costs array and length_array. */
+
+    if (match_type == ML_RLE) {
+      /* If we're in a long repetition of the same character and have more than
+       ZOPFLI_MAX_MATCH characters after our position. */
+      const unsigned char* match_end = GetMatch(&in[i], &in[i - 1], &in[inend], &in[inend] - 8);
+      if (match_end >= &in[i] + ZOPFLI_MAX_MATCH) {
+        unsigned match = match_end - &in[i] - ZOPFLI_MAX_MATCH + 1;
+
+        float symbolcost = costcontext->ll_symbols[285] + costcontext->d_symbols[0];
+        /* Set the length to reach each one to ZOPFLI_MAX_MATCH, and the cost to
+         the cost corresponding to that length. Doing this, we skip
+         ZOPFLI_MAX_MATCH values to avoid calling ZopfliFindLongestMatch. */
+        for (unsigned k = 0; k < match; k++) {
+          costs[j + ZOPFLI_MAX_MATCH] = costs[j] + symbolcost;
+          length_array[j + ZOPFLI_MAX_MATCH] = ZOPFLI_MAX_MATCH + (1 << 9);
+          j++;
+        }
+
+        i += match;
+      }
+      match_type = 0;
+    }
+
+    unsigned short* matches = c->cache + c->pointer;
+    int numPairs = *matches;
+    matches++;
+    c->pointer += numPairs + 1;
+
+    if (numPairs){
+      const unsigned short * mend = matches + numPairs;
+
+      if (matches[0] == ZOPFLI_MAX_MATCH) {
+        unsigned dist = matches[1];
+        if (dist == 1) {match_type = ML_RLE;}
+
+        costs[j + ZOPFLI_MAX_MATCH] = costs[j] + disttable[dist] + litlentable[ZOPFLI_MAX_MATCH];
+        length_array[j + ZOPFLI_MAX_MATCH] = ZOPFLI_MAX_MATCH + (dist << 9);
+
+      }
+#if 0 //More speed, less compression.
+      else if (*(mend - 2) == ZOPFLI_MAX_MATCH){
+        unsigned dist = matches[numPairs - 1];
+        costs[j + ZOPFLI_MAX_MATCH] = costs[j] + disttable[dist] + litlentable[ZOPFLI_MAX_MATCH];
+        length_array[j + ZOPFLI_MAX_MATCH] = ZOPFLI_MAX_MATCH + (dist << 9);
+      }
+#endif
+      else{
+        float price = costs[j];
+        unsigned short* mp = matches;
+
+        unsigned curr = ZOPFLI_MIN_MATCH;
+        while (mp < mend){
+          unsigned len = *mp++;
+          unsigned dist = *mp++;
+          float price2 = price + disttable[dist];
+          dist <<=9;
+#if RELAX_ISA >= ZOPFLI_CPU_AVX512
+          RelaxRangeAVX512(price2, litlentable, costs + j, length_array + j, curr, len, dist);
+          curr = len + 1;
+#elif RELAX_ISA >= ZOPFLI_CPU_AVX
+          for (; curr + 8 < len; curr+=8) {
+            __m256 x8 = _mm256_add_ps(_mm256_set1_ps(price2), _mm256_loadu_ps(&litlentable[curr]));
+            __m256 vcost = _mm256_loadu_ps(&costs[j + curr]);
+            _mm256_storeu_ps(&costs[j + curr], _mm256_min_ps(x8, vcost));
+#if RELAX_ISA >= ZOPFLI_CPU_AVX2
+            __m256i cmp_mask = _mm256_castps_si256(_mm256_cmp_ps(x8, vcost, _CMP_LT_OQ));
+            __m256i vlength = _mm256_add_epi32(_mm256_set1_epi32(curr + dist), _mm256_setr_epi32(0,1,2,3,4,5,6,7));
+            vlength = _mm256_blendv_epi8(_mm256_loadu_si256((__m256i*)&length_array[j + curr]), vlength, cmp_mask);
+#else
+            __m128i vlength_low = _mm_add_epi32(_mm_set1_epi32(curr + dist), _mm_setr_epi32(0, 1, 2, 3));
+            __m128i vlength_high = _mm_add_epi32(_mm_set1_epi32(curr + dist), _mm_setr_epi32(4, 5, 6, 7));
+            __m256i vlength = _mm256_set_m128i(vlength_high, vlength_low);
+            vlength = _mm256_castps_si256(_mm256_blendv_ps(_mm256_castsi256_ps(_mm256_loadu_si256((__m256i*)&length_array[j + curr])),
+                                                                               _mm256_castsi256_ps(vlength), _mm256_cmp_ps(x8, vcost, _CMP_LT_OQ)));
+#endif
+            _mm256_storeu_si256((__m256i*)&length_array[j + curr], vlength);
+          }
+#endif
+#if RELAX_ISA >= ZOPFLI_CPU_SSE2 && RELAX_ISA < ZOPFLI_CPU_AVX512
+          for (; curr + 4 < len; curr += 4) {
+            __m128 x4 = _mm_add_ps(_mm_set1_ps(price2), _mm_loadu_ps(&litlentable[curr]));
+            __m128 vcost = _mm_loadu_ps(&costs[j + curr]);
+            _mm_storeu_ps(&costs[j + curr], _mm_min_ps(x4, vcost));
+            __m128i vlength = _mm_add_epi32(_mm_set1_epi32(curr + dist), _mm_setr_epi32(0, 1, 2, 3));
+            __m128i cmp_mask = _mm_castps_si128(_mm_cmplt_ps(x4, vcost));
+            __m128i old_vlength = _mm_loadu_si128((__m128i*)&length_array[j + curr]);
+#if RELAX_ISA >= ZOPFLI_CPU_SSE4_2
+            vlength = _mm_blendv_epi8(old_vlength, vlength, cmp_mask);
+#else
+            vlength = _mm_or_si128(_mm_and_si128(vlength, cmp_mask), _mm_andnot_si128(cmp_mask, old_vlength));
+#endif
+            _mm_storeu_si128((__m128i*)&length_array[j + curr], vlength);
+          }
+#elif defined(ZOPFLI_NEON)
+          RelaxRangeNEON(price2, litlentable, costs + j, length_array + j, curr, len, dist);
+          curr = len + 1;
+#endif
+#ifdef __GNUC__
+#pragma GCC unroll 1 /* no unroll */
+#endif
+          for (; curr <= len; curr++) {
+            float x = price2 + litlentable[curr];
+            if (x < costs[j + curr]){
+              costs[j + curr] = x;
+              length_array[j + curr] = curr + dist;
+            }
+          }
+        }
+      }
+    }
+
+    /* Literal. */
+    float newCost = costs[j] + literals[in[i]];
+    if (newCost < costs[j + 1]) {
+      costs[j + 1] = newCost;
+      length_array[j + 1] = 1U + (in[i] << 24);
+    }
+  }
+}
+
+#undef RELAX_NAME
+#undef RELAX_ISA
+#undef RELAX_TARGET
@@ -0,0 +1,166 @@
+/*
+GetBestLengths2 main loop on 16-bit fixed-point costs, included by squeeze.c
+once per instruction set level like squeeze_relax.h. Costs wrap around, so they
+are compared by the sign of their 16-bit difference; see COST16_SHIFT. The
+vector loops read and write back up to 15 entries past the end of a match, so
+litlentable, costs and length_array need that much padding.
+*/
+
+static RELAX_TARGET void RELAX_NAME(const unsigned char* in, size_t instart, size_t inend,
+                                    const unsigned short* literals, const unsigned short* litlentable,
+                                    const unsigned short* disttable,
+                                    unsigned short* costs, unsigned* length_array, LZCache* c) {
+  size_t i;
+  size_t blocksize = inend - instart;
+  size_t initialized = 1;  /* costs below this index hold a value. */
+  //Special handling for files with high redundancy
+  unsigned match_type = 0;
+
+  for (i = instart; i < inend; i++) {
+    size_t j = i - instart;  /* Index in the costs array and length_array. */
+
+    if (match_type == ML_RLE) {
+      const unsigned char* match_end = GetMatch(&in[i], &in[i - 1], &in[inend], &in[inend] - 8);
+      if (match_end >= &in[i] + ZOPFLI_MAX_MATCH) {
+        unsigned match = match_end - &in[i] - ZOPFLI_MAX_MATCH + 1;
+
+        /* Positions left unreached after the skip would keep their far cost
+        instead of an infinite one and could end up on the path, so reach them
+        from the run here: j + 1 by a literal, j + 2 by a length 3 match from
+        j - 1 and the rest by matches from j. */
+        unsigned short x = costs[j] + literals[in[i]];
+        if ((short)(x - costs[j + 1]) < 0) {
+          costs[j + 1] = x;
+          length_array[j + 1] = 1U + (in[i] << 24);
+        }
+        x = costs[j - 1] + disttable[1] + litlentable[ZOPFLI_MIN_MATCH];
+        if ((short)(x - costs[j + 2]) < 0) {
+          costs[j + 2] = x;
+          length_array[j + 2] = ZOPFLI_MIN_MATCH + (1 << 9);
+        }
+        for (unsigned len = ZOPFLI_MIN_MATCH; len < ZOPFLI_MAX_MATCH; len++) {
+          x = costs[j] + disttable[1] + litlentable[len];
+          if ((short)(x - costs[j + len]) < 0) {
+            costs[j + len] = x;
+            length_array[j + len] = len + (1 << 9);
+          }
+        }
+
+        unsigned short symbolcost = litlentable[ZOPFLI_MAX_MATCH] + disttable[1];
+        for (unsigned k = 0; k < match; k++) {
+          costs[j + ZOPFLI_MAX_MATCH] = costs[j] + symbolcost;
+          length_array[j + ZOPFLI_MAX_MATCH] = ZOPFLI_MAX_MATCH + (1 << 9);
+          j++;
+        }
+
+        i += match;
+        if (initialized < j + ZOPFLI_MAX_MATCH) initialized = j + ZOPFLI_MAX_MATCH;
+      }
+      match_type = 0;
+    }
+
+    /* Positions first reachable from here start out of reach. */
+    size_t reach = j + ZOPFLI_MAX_MATCH + 1 > blocksize + 1 ? blocksize + 1 : j + ZOPFLI_MAX_MATCH + 1;
+    for (; initialized < reach; initialized++) {
+      costs[initialized] = costs[j] + COST16_FAR;
+    }
+
+    unsigned short* matches = c->cache + c->pointer;
+    int numPairs = *matches;
+    matches++;
+    c->pointer += numPairs + 1;
+
+    if (numPairs){
+      const unsigned short * mend = matches + numPairs;
+
+      if (matches[0] == ZOPFLI_MAX_MATCH) {
+        unsigned dist = matches[1];
+        if (dist == 1) {match_type = ML_RLE;}
+
+        costs[j + ZOPFLI_MAX_MATCH] = costs[j] + disttable[dist] + litlentable[ZOPFLI_MAX_MATCH];
+        length_array[j + ZOPFLI_MAX_MATCH] = ZOPFLI_MAX_MATCH + (dist << 9);
+      }
+      else{
+        unsigned short price = costs[j];
+        unsigned short* mp = matches;
+
+        unsigned curr = ZOPFLI_MIN_MATCH;
+        while (mp < mend){
+          unsigned len = *mp++;
+          unsigned dist = *mp++;
+          unsigned short price2 = price + disttable[dist];
+          dist <<=9;
+          /* Whole vectors, the lanes past len masked off. */
+#if RELAX_ISA >= ZOPFLI_CPU_AVX2
+          for (; curr <= len; curr += 16) {
+            __m256i x16 = _mm256_add_epi16(_mm256_set1_epi16(price2), _mm256_loadu_si256((const __m256i*)&litlentable[curr]));
+            __m256i vcost = _mm256_loadu_si256((const __m256i*)&costs[j + curr]);
+            __m256i in_range = _mm256_cmpgt_epi16(_mm256_set1_epi16(len - curr + 1),
+                                                  _mm256_setr_epi16(0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15));
+            __m256i lt = _mm256_and_si256(_mm256_srai_epi16(_mm256_sub_epi16(x16, vcost), 15), in_range);
+            _mm256_storeu_si256((__m256i*)&costs[j + curr], _mm256_blendv_epi8(vcost, x16, lt));
+            __m256i vlength = _mm256_add_epi32(_mm256_set1_epi32(curr + dist), _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7));
+            _mm256_maskstore_epi32((int*)&length_array[j + curr], _mm256_cvtepi16_epi32(_mm256_castsi256_si128(lt)), vlength);
+            _mm256_maskstore_epi32((int*)&length_array[j + curr + 8], _mm256_cvtepi16_epi32(_mm256_extracti128_si256(lt, 1)),
+                                   _mm256_add_epi32(vlength, _mm256_set1_epi32(8)));
+          }
+#elif RELAX_ISA >= ZOPFLI_CPU_SSE2
+          for (; curr <= len; curr += 8) {
+            __m128i x8 = _mm_add_epi16(_mm_set1_epi16(price2), _mm_loadu_si128((const __m128i*)&litlentable[curr]));
+            __m128i vcost = _mm_loadu_si128((const __m128i*)&costs[j + curr]);
+            __m128i in_range = _mm_cmpgt_epi16(_mm_set1_epi16(len - curr + 1), _mm_setr_epi16(0, 1, 2, 3, 4, 5, 6, 7));
+            __m128i lt = _mm_and_si128(_mm_srai_epi16(_mm_sub_epi16(x8, vcost), 15), in_range);
+            if (!_mm_movemask_epi8(lt)) continue;
+            _mm_storeu_si128((__m128i*)&costs[j + curr], _mm_or_si128(_mm_and_si128(lt, x8), _mm_andnot_si128(lt, vcost)));
+            __m128i vlength = _mm_add_epi32(_mm_set1_epi32(curr + dist), _mm_setr_epi32(0, 1, 2, 3));
+            __m128i mask = _mm_unpacklo_epi16(lt, lt);
+            __m128i old = _mm_loadu_si128((const __m128i*)&length_array[j + curr]);
+            _mm_storeu_si128((__m128i*)&length_array[j + curr], _mm_or_si128(_mm_and_si128(mask, vlength), _mm_andnot_si128(mask, old)));
+            vlength = _mm_add_epi32(vlength, _mm_set1_epi32(4));
+            mask = _mm_unpackhi_epi16(lt, lt);
+            old = _mm_loadu_si128((const __m128i*)&length_array[j + curr + 4]);
+            _mm_storeu_si128((__m128i*)&length_array[j + curr + 4], _mm_or_si128(_mm_and_si128(mask, vlength), _mm_andnot_si128(mask, old)));
+          }
+#elif defined(ZOPFLI_NEON)
+          for (; curr <= len; curr += 8) {
+            static const short lanes[8] = {0, 1, 2, 3, 4, 5, 6, 7};
+            uint16x8_t x8 = vaddq_u16(vdupq_n_u16(price2), vld1q_u16(&litlentable[curr]));
+            uint16x8_t vcost = vld1q_u16(&costs[j + curr]);
+            uint16x8_t in_range = vcgtq_s16(vdupq_n_s16(len - curr + 1), vld1q_s16(lanes));
+            uint16x8_t lt = vandq_u16(vreinterpretq_u16_s16(vshrq_n_s16(vreinterpretq_s16_u16(vsubq_u16(x8, vcost)), 15)), in_range);
+            vst1q_u16(&costs[j + curr], vbslq_u16(lt, x8, vcost));
+            int16x8_t slt = vreinterpretq_s16_u16(lt);
+            uint32x4_t vlength = vaddq_u32(vdupq_n_u32(curr + dist), vld1q_u32(relax_steps));
+            uint32x4_t mask = vreinterpretq_u32_s32(vmovl_s16(vget_low_s16(slt)));
+            vst1q_u32(&length_array[j + curr], vbslq_u32(mask, vlength, vld1q_u32(&length_array[j + curr])));
+            vlength = vaddq_u32(vlength, vdupq_n_u32(4));
+            mask = vreinterpretq_u32_s32(vmovl_s16(vget_high_s16(slt)));
+            vst1q_u32(&length_array[j + curr + 4], vbslq_u32(mask, vlength, vld1q_u32(&length_array[j + curr + 4])));
+          }
+#endif
+#if RELAX_ISA >= ZOPFLI_CPU_SSE2 || defined(ZOPFLI_NEON)
+          curr = len + 1;
+#endif
+          for (; curr <= len; curr++) {
+            unsigned short x = price2 + litlentable[curr];
+            if ((short)(x - costs[j + curr]) < 0){
+              costs[j + curr] = x;
+              length_array[j + curr] = curr + dist;
+            }
+          }
+        }
+      }
+    }
+
+    /* Literal. */
+    unsigned short newCost = costs[j] + literals[in[i]];
+    if ((short)(newCost - costs[j + 1]) < 0) {
+      costs[j + 1] = newCost;
+      length_array[j + 1] = 1U + (in[i] << 24);
+    }
+  }
+}
+
+#undef RELAX_NAME
+#undef RELAX_ISA
+#undef RELAX_TARGET
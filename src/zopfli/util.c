@@ -46,10 +46,39 @@ static const ZopfliOptionsMin opt[8] =
 
 void ZopfliInitOptions(ZopfliOptions* options, unsigned _mode, unsigned isPNG) {
   options->twice = (_mode - (_mode % 10000)) / 10000;
+  options->costmodel_in = 0;
+  options->costmodel_out = 0;
+  options->restartinterval = 0;
+  options->restartindex = 0;
+  options->membersize = 0;
+  options->bgzf = 0;
+  options->numthreads = 1;
+  options->stats = 0;
+  options->splitdp = 0;
+  options->adaptive = 0;
+  options->convergence = 0;
+  options->chain = 650;
   unsigned mode = _mode % 10000 > 9 ? 9 : _mode % 10000;
+  options->fixedcosts = mode == 5;  /* Faster there, sizes within +-0.06% of floats. */
   if (mode < 2){
-    //mode 1 means zlib is used instead, use negative iterations to indicate this.
-    options->numiterations = -1;
+    /* The lazy parse is written out as is, with short hash chains at level 0. */
+    options->numiterations = 0;
+    options->searchext = 0;
+    options->filter_style = 0;
+    options->noblocksplit = 2000;
+    options->trystatic = 0;
+    options->skipdynamic = 0;
+    options->noblocksplitlz = 800;
+    options->num = 3;
+    options->replaceCodes = 0;
+    options->isPNG = isPNG;
+    options->reuse_costmodel = 0;
+    options->useCache = 0;
+    options->ultra = 0;
+    options->entropysplit = 1;
+    options->greed = 258;
+    options->chain = mode ? 128 : 8;
+    options->advanced = 0;
     return;
   }
 
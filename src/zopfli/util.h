@@ -117,6 +117,13 @@ Used to initialize costs for example
 */
 #define ZOPFLI_LARGE_FLOAT 1e30
 
+/* State kept between blocks is per thread, so separate compressions can run in parallel. */
+#if defined(_MSC_VER)
+#define ZOPFLI_TLS __declspec(thread)
+#else
+#define ZOPFLI_TLS __thread
+#endif
+
 #ifdef __GNUC__
 #define likely(x)      __builtin_expect(!!(x), 1)
 #define unlikely(x)    __builtin_expect(!!(x), 0)
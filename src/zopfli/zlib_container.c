@@ -21,48 +21,37 @@ Author: jyrki.alakuijala@gmail.com (Jyrki Alakuijala)
 #include "zlib_container.h"
 #include "util.h"
 
-/* Calculates the adler32 checksum of the data */
-static unsigned adler32(unsigned adler, const unsigned char* data, size_t size)
-{
-  enum {sums_overflow = 5552};
-  unsigned s1 = adler & 0xffff, s2 = adler >> 16;
-
-  while (size > 0) {
-    size_t amount = size > sums_overflow ? sums_overflow : size;
-    size -= amount;
-#ifdef __GNUC__
-#pragma GCC unroll 1 /* no unroll */
-#endif
-    do {
-      s1 += (*data++);
-      s2 += s1;
-      amount--;
-    } while (amount > 0);
-    s1 %= 65521;
-    s2 %= 65521;
-  }
-
-  return (s2 << 16) | s1;
-}
-
-void ZopfliZlibCompress(const ZopfliOptions* options,
-                        const unsigned char* in, size_t insize,
-                        unsigned char** out, size_t* outsize) {
+void ZopfliZlibCompressDict(const ZopfliOptions* options,
+                            const unsigned char* dict, size_t dictsize,
+                            const unsigned char* in, size_t insize,
+                            unsigned char** out, size_t* outsize) {
   unsigned char bitpointer = 0;
-  unsigned checksum = adler32(1, in, (unsigned)insize);
+  unsigned checksum = ZopfliAdler32(1, in, insize);
   unsigned cmf = 120;  /* CM 8, CINFO 7. See zlib spec.*/
   unsigned flevel = 3;
-  unsigned fdict = 0;
+  unsigned fdict = dictsize != 0;
   unsigned cmfflg = 256 * cmf + fdict * 32 + flevel * 64;
   unsigned fcheck = 31 - cmfflg % 31;
   cmfflg += fcheck;
 
   unsigned char hdr[2] = {cmfflg / 256, cmfflg % 256};
   ZOPFLI_APPEND_ARRAY(hdr, out, outsize);
+  if (fdict) {
+    /* DICTID covers the whole dictionary, as passed to inflateSetDictionary. */
+    unsigned dictid = ZopfliAdler32(1, dict, dictsize);
+    unsigned char id[4] = {dictid >> 24, (dictid >> 16) % 256, (dictid >> 8) % 256, dictid % 256};
+    ZOPFLI_APPEND_ARRAY(id, out, outsize);
+  }
 
-  ZopfliDeflate(options, 1 /* final */,
-                in, insize, &bitpointer, out, outsize);
+  ZopfliDeflateDict(options, 1 /* final */, dict, dictsize,
+                    in, insize, &bitpointer, out, outsize);
 
-  unsigned char ftr[4] = {(checksum >> 24) % 256, (checksum >> 24) % 256, (checksum >> 24) % 256, checksum % 256};
+  unsigned char ftr[4] = {checksum >> 24, (checksum >> 16) % 256, (checksum >> 8) % 256, checksum % 256};
   ZOPFLI_APPEND_ARRAY(ftr, out, outsize);
 }
+
+void ZopfliZlibCompress(const ZopfliOptions* options,
+                        const unsigned char* in, size_t insize,
+                        unsigned char** out, size_t* outsize) {
+  ZopfliZlibCompressDict(options, NULL, 0, in, insize, out, outsize);
+}
@@ -43,6 +43,26 @@ void ZopfliZlibCompress(const ZopfliOptions* options,
                         const unsigned char* in, size_t insize,
                         unsigned char** out, size_t* outsize);
 
+/*
+Same as ZopfliZlibCompress, but primes the compressor with a preset dictionary
+and sets FDICT/DICTID in the header. The decompressor must supply the same
+dictionary, e.g. with zlib's inflateSetDictionary.
+
+dict: the dictionary bytes
+dictsize: number of dictionary bytes, 0 writes a plain zlib stream
+*/
+void ZopfliZlibCompressDict(const ZopfliOptions* options,
+                            const unsigned char* dict, size_t dictsize,
+                            const unsigned char* in, size_t insize,
+                            unsigned char** out, size_t* outsize);
+
+/*
+Updates the Adler-32 checksum of a stream with the next size bytes and returns
+it; start with adler 1. Uses SIMD where the CPU supports it. Lets callers that
+write the zlib container themselves checksum their data as it arrives.
+*/
+unsigned ZopfliAdler32(unsigned adler, const unsigned char* data, size_t size);
+
 #ifdef __cplusplus
 }  // extern "C"
 #endif
@@ -29,6 +29,41 @@ Author: jyrki.alakuijala@gmail.com (Jyrki Alakuijala)
 extern "C" {
 #endif
 
+/*
+A cost model of the optimal LZ77 parser: the symbol frequencies of a parse and
+the bit lengths derived from them. A model learned on one file can warm-start
+the compression of similar files.
+*/
+typedef struct ZopfliCostModel {
+  unsigned litlens[288];
+  unsigned dists[32];
+  float ll_symbols[288];
+  float d_symbols[32];
+} ZopfliCostModel;
+
+/* Size of a serialized ZopfliCostModel in bytes. */
+#define ZOPFLI_COSTMODEL_SIZE (4 + 8 * (288 + 32))
+
+/*
+A point where decompression can start: a deflate block begins on this byte
+boundary, and neither it nor any later block references data before it.
+*/
+typedef struct ZopfliRestartPoint {
+  size_t in;  /* Offset in the uncompressed data. */
+  size_t out;  /* Offset in the output array, e.g. in the gzip file. */
+} ZopfliRestartPoint;
+
+typedef struct ZopfliRestartIndex {
+  ZopfliRestartPoint* points;
+  size_t size;
+} ZopfliRestartIndex;
+
+/* Counters for tuning the iterations of the optimal parse. */
+typedef struct ZopfliStats {
+  size_t iterations;  /* Iterations run. */
+  size_t iterationsskipped;  /* Iterations left out because the cost converged. */
+} ZopfliStats;
+
 /*
 Options used throughout the program.
 */
@@ -37,7 +72,8 @@ typedef struct ZopfliOptions {
   /*
   Maximum amount of times to rerun forward and backward pass to optimize LZ77
   compression cost. Good values: 10, 15 for small files, 5 for files over
-  several MB in size or it will be too slow.
+  several MB in size or it will be too slow. 0 writes the lazy parse without
+  optimizing it, as levels 0 and 1 do.
   */
   int numiterations;
 
@@ -86,16 +122,80 @@ typedef struct ZopfliOptions {
   /*Use greedy search instead of lazy search above this value.*/
   unsigned greed;
 
+  /*Maximum number of hash chain entries the lazy parser checks per position.*/
+  unsigned chain;
+
   /*Use shannon entropy instead of real code lengths in blocksplitting.*/
   unsigned entropysplit;
 
+  /*Split blocks with a shortest-path search over candidate boundaries instead of recursively.*/
+  unsigned splitdp;
+
+  /*Move iterations from blocks where they find little, such as nearly incompressible ones, to blocks where they pay off.*/
+  unsigned adaptive;
+
+  /*If not 0, stop iterating once the best cost improved by at most a ten-thousandth over this many iterations (at most 63).*/
+  unsigned convergence;
+
   /*Use advanced huffman and header optimizations.*/
   unsigned advanced;
+
+  /*Use 16-bit fixed-point costs (quarter bits) instead of floats in the iterations that read the match cache.*/
+  unsigned fixedcosts;
+
+  /*Starting cost model instead of the block splitting statistics, or NULL. Only used with reuse_costmodel.*/
+  const ZopfliCostModel* costmodel_in;
+
+  /*If not NULL, receives the cost model learned while compressing.*/
+  ZopfliCostModel* costmodel_out;
+
+  /*Make every restartinterval-th master block a restart point, 0 to disable.*/
+  unsigned restartinterval;
+
+  /*If not NULL, restart points are appended to it. The start of the stream counts as the first one.*/
+  ZopfliRestartIndex* restartindex;
+
+  /*Write gzip output as a series of members of at most this many input bytes each, 0 for a single member.*/
+  size_t membersize;
+
+  /*Write BGZF: members of at most 65280 input bytes with the BC extra field, followed by the EOF marker.*/
+  unsigned bgzf;
+
+  /*Number of threads compressing gzip members in parallel.*/
+  unsigned numthreads;
+
+  /*If not NULL, the counters of this run are added to it.*/
+  ZopfliStats* stats;
 } ZopfliOptions;
 
 /* Initializes options with default values. */
 void ZopfliInitOptions(ZopfliOptions* options, unsigned level, unsigned isPNG);
 
+/*
+Serializes a cost model into ZOPFLI_COSTMODEL_SIZE bytes of out. The format is
+portable across platforms.
+*/
+void ZopfliSaveCostModel(const ZopfliCostModel* model, unsigned char* out);
+
+/*
+Deserializes a cost model written by ZopfliSaveCostModel. Returns 1 on success,
+0 if the data is not a valid cost model.
+*/
+int ZopfliLoadCostModel(ZopfliCostModel* model, const unsigned char* in, size_t insize);
+
+void ZopfliInitRestartIndex(ZopfliRestartIndex* index);
+void ZopfliCleanRestartIndex(ZopfliRestartIndex* index);
+
+/*
+Serializes a restart index into a compact sidecar and appends it to out:
+"ZRI" and a version byte 1, then the number of points and for each point the
+deltas of its in and out offsets to the previous point, all as LEB128.
+To seek, decode raw deflate from the out offset of the last point whose in
+offset is not past the target.
+*/
+void ZopfliSaveRestartIndex(const ZopfliRestartIndex* index,
+                            unsigned char** out, size_t* outsize);
+
 /* Output format */
 typedef enum {
   ZOPFLI_FORMAT_GZIP,
@@ -117,6 +217,29 @@ void ZopfliCompress(const ZopfliOptions* options, ZopfliFormat output_type,
                     const unsigned char* in, size_t insize,
                     unsigned char** out, size_t* outsize);
 
+/* Accuracy tiers of ZopfliEstimateSize, from fastest to most accurate. */
+typedef enum {
+  ZOPFLI_ESTIMATE_SAMPLED,  /* Sampled windows with greedy hashed matches. */
+  ZOPFLI_ESTIMATE_LAZY,  /* Lazy LZ77 and the size of a dynamic block per MB. */
+  ZOPFLI_ESTIMATE_OPTIMAL  /* One iteration of the optimal parse on top. */
+} ZopfliEstimateTier;
+
+/*
+Estimates the raw deflate size of in in bytes, to decide cheaply whether and
+how hard to compress it. Only options->numthreads is used, to estimate 1 MB
+chunks of the slower tiers in parallel; options may be NULL. Deviation from
+level 4 output and speed with one thread, measured on text, source code, JSON,
+binaries, a tar mix, random data and long runs:
+SAMPLED: 0 to 28% too high, plus up to 40 bytes per 64 KB, 80 to 390 MB/s.
+  Reads all of inputs up to 4 MB and 1/16 of larger ones, which can be off
+  either way where sampled windows are not representative.
+LAZY: 0 to 21% too high, 12 to 40 MB/s, 3 to 11 times as fast as level 2.
+OPTIMAL: 0 to 9% too high, about as fast as level 2.
+Only inputs over 1 MB get faster with numthreads > 1.
+*/
+size_t ZopfliEstimateSize(const ZopfliOptions* options, ZopfliEstimateTier tier,
+                          const unsigned char* in, size_t insize);
+
 #ifdef __cplusplus
 }  // extern "C"
 #endif
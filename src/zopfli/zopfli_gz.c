@@ -39,26 +39,18 @@ static int SaveFile(const char* filename, const unsigned char* in, size_t insize
 /*
  outfilename: filename to write output to, or 0 to write to stdout instead
  */
-int ZopfliGzip(const char* infilename, const char* outfilename, unsigned level, const char* gzip_name, unsigned time) {
+int ZopfliGzip(const char* infilename, const char* outfilename, const ZopfliOptions* options, const char* gzip_name, unsigned time) {
   unsigned char* in = 0;
   size_t insize = 0;
   unsigned char* out = 0;
   size_t outsize = 0;
 
-  ZopfliOptions options;
-  ZopfliInitOptions(&options, level, 0);
-  if (options.numiterations == -1) {
-    /* the level actually can be 2-9, 10002-10009, ... */
-    /* unsupported level */
-    return -2; /* Z_STREAM_ERROR - input param error */
-  }
-
   if (!LoadFile(infilename, &in, &insize)) {
     /* fprintf(stderr, "Invalid input: %s\n", infilename); */
     return -3; /* Z_DATA_ERROR - input data error */
   }
 
-  ZopfliGzipCompressEx(&options, in, insize, &out, &outsize, time, gzip_name);
+  ZopfliGzipCompressEx(options, in, insize, &out, &outsize, time, gzip_name);
   free(in);
 
   if (!SaveFile(outfilename, out, outsize)) {
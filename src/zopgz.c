@@ -36,7 +36,7 @@
 #include "ungzlib.h"
 #include "zopfli_lib.h"
 
-extern int ZopfliGzip(const char* infilename, const char* outfilename, unsigned mode, const char* gzip_name, unsigned time);
+extern int ZopfliGzip(const char* infilename, const char* outfilename, const ZopfliOptions* options, const char* gzip_name, unsigned time);
 
 /* Globals */
 static unsigned char g_level = 3;
@@ -56,6 +56,17 @@ static char g_keep_input = 0;
 static char g_recursive = 0;   /* parsed for compatibility; error after parsing */
 static char g_decompress = 0;
 static int g_verbose = 0;
+static const char* g_load_model = NULL;
+static const char* g_save_model = NULL;
+static ZopfliCostModel g_model_in;
+static ZopfliCostModel g_model_out;
+static unsigned g_restart = 0;
+static size_t g_member_size = 0;
+static char g_bgzf = 0;
+static unsigned g_threads = 0; /* 0: one per CPU */
+static char g_split_dp = 0;
+static char g_adaptive = 0;
+static char g_converge = 0;
 
 /* Helpers */
 static void usage(FILE* out) {
@@ -66,7 +77,7 @@ static void usage(FILE* out) {
         "\n"
         "Mandatory arguments to long options are mandatory for short options too.\n"
         "\n"
-        "  -1 .. -9           compression level. (default is 3)\n"
+        "  -0 .. -9           compression level, 0 and 1 are fast. (default is 3)\n"
         "  --fast, --best     aliases for -1 and -9 (discouraged)\n"
         "  -d, --decompress   decompress (instead of compress)\n"
         "  -n, --no-name      omit/ignore filename (and mtime)\n"
@@ -77,6 +88,16 @@ static void usage(FILE* out) {
         "  -f, --force        force overwrite of output file and compress links\n"
         "  -q, --quiet        suppress warnings\n"
         "  -v, --verbose      verbose mode (more info output)\n"
+        "  --load-model=FILE  start from the cost model saved in FILE\n"
+        "  --save-model=FILE  save the learned cost model to FILE\n"
+        "  --restart=N        byte-align and reset history every N master blocks,\n"
+        "                     writing a seek index to the output file + .idx\n"
+        "  --members=SIZE     write gzip members of SIZE input bytes (k/m suffixes)\n"
+        "  --bgzf             write BGZF (members of at most 64 KiB with BC field)\n"
+        "  --threads=N        compress members with N threads (default: all CPUs)\n"
+        "  --split-dp         split blocks with a global search\n"
+        "  --adaptive         move iterations to the blocks where they pay off\n"
+        "  --converge         stop iterating once the size stops improving\n"
         "  -h, --help         show this help\n"
     );
 }
@@ -109,6 +130,17 @@ static char* make_outname_with_suffix(const char* in, const char* suffix) {
     return make_joint_path(in, n, suffix, s);
 }
 
+/* Returns the value of "NAME=VALUE" in a, or NULL if a is not option NAME. */
+static const char* long_opt_value(const char* a, const char* name) {
+    size_t n = strlen(name);
+    if (strncmp(a, name, n) != 0 || (a[n] != '=' && a[n] != '\0')) return NULL;
+    if (a[n] == '\0' || a[n+1] == '\0') {
+        fprintf(stderr, "zopgz: %s requires a value, use %s=VALUE\n", name, name);
+        exit(2);
+    }
+    return a + n + 1;
+}
+
 static void parse_args(int argc, char** argv) {
     int end_of_opts = 0;
     for (int i = 1; i < argc; ++i) {
@@ -151,6 +183,45 @@ static void parse_args(int argc, char** argv) {
         if (strcmp(a, "--rsyncable") == 0) { /* do nothing */ continue; }
         if (strcmp(a, "--verbose") == 0) { g_verbose++; continue; }
         if (strcmp(a, "--decompress") == 0) { g_decompress = 1; continue; }
+        const char* v;
+        if ((v = long_opt_value(a, "--load-model"))) { g_load_model = v; continue; }
+        if ((v = long_opt_value(a, "--save-model"))) { g_save_model = v; continue; }
+        if ((v = long_opt_value(a, "--restart"))) {
+            char* end;
+            unsigned long n = strtoul(v, &end, 10);
+            if (*end || n == 0 || n > 65535) {
+                fprintf(stderr, "zopgz: --restart needs a number of master blocks (1-65535)\n");
+                exit(2);
+            }
+            g_restart = (unsigned)n;
+            continue;
+        }
+        if ((v = long_opt_value(a, "--members"))) {
+            char* end;
+            unsigned long long n = strtoull(v, &end, 10);
+            if (*end == 'k' || *end == 'K') { n <<= 10; end++; }
+            else if (*end == 'm' || *end == 'M') { n <<= 20; end++; }
+            if (*end || n == 0 || n != (size_t)n) {
+                fprintf(stderr, "zopgz: --members needs a member size in bytes\n");
+                exit(2);
+            }
+            g_member_size = (size_t)n;
+            continue;
+        }
+        if (strcmp(a, "--bgzf") == 0) { g_bgzf = 1; continue; }
+        if (strcmp(a, "--split-dp") == 0) { g_split_dp = 1; continue; }
+        if (strcmp(a, "--adaptive") == 0) { g_adaptive = 1; continue; }
+        if (strcmp(a, "--converge") == 0) { g_converge = 1; continue; }
+        if ((v = long_opt_value(a, "--threads"))) {
+            char* end;
+            unsigned long n = strtoul(v, &end, 10);
+            if (*end || n == 0 || n > 1024) {
+                fprintf(stderr, "zopgz: --threads needs a number of threads (1-1024)\n");
+                exit(2);
+            }
+            g_threads = (unsigned)n;
+            continue;
+        }
         if (strncmp(a, "--suffix", 8) == 0) {
             if (a[8] == '=' && a[9] != '\0') { g_suffix = a + 9; continue; }
             if (a[8] == '=' || a[8] == '\0') {
@@ -169,9 +240,9 @@ static void parse_args(int argc, char** argv) {
         /* short options / clusters */
         for (int j = 1; a[j] != '\0'; ++j) {
             char c = a[j];
-            if (c >= '1' && c <= '9') {
+            if (c >= '0' && c <= '9') {
                 if (a[j+1] >= '0' && a[j+1] <= '9') {
-                    fprintf(stderr, "zopgz: compression level only 1-9\n");
+                    fprintf(stderr, "zopgz: compression level only 0-9\n");
                     exit(2);
                 }
                 g_level = (unsigned)(c - '0'); continue;
@@ -210,6 +281,14 @@ static void parse_args(int argc, char** argv) {
     g_suffix_len = 3; /* unconditionally for .gz first */
     if (g_suffix) g_suffix_len = strlen(g_suffix);
     else if (!g_decompress) g_suffix = known_suffixes_gz; /* .gz */
+    if ((g_load_model || g_save_model) && !g_decompress && g_level < 2) {
+        fprintf(stderr, "zopgz: cost models need compression level 2-9\n");
+        exit(2);
+    }
+    if (g_restart && (g_member_size || g_bgzf)) {
+        fprintf(stderr, "zopgz: --restart can't be combined with members, every member can be decoded on its own\n");
+        exit(2);
+    }
     if (g_recursive) {
         fprintf(stderr, "zopgz: recursive mode is not supported. consider: find DIR -type f -exec zopgz {} \\;\n");
         exit(2);
@@ -420,68 +499,51 @@ fail:
     return outpath;
 }
 
-static int zlib_gz(const char* inpath, const char* outpath, unsigned level, const char* fname, unsigned mtime) {
-    unsigned char* in = 0;
-    size_t insize = 0;
-    int ret = 0;
-    FILE* infile = inpath ? fopen(inpath, "rb") : stdin;
-    if (!infile) return -3;
-    FILE* outfile = outpath ? fopen(outpath, "wb") : stdout;
-    if (!outfile) {
-        if (infile != stdin) fclose(infile);
-        return -1;
-    }
-    size_t name_len = (fname && *fname) ? strlen(fname) : 0;
-
-    if (!ZopfliLoadFile(infile, &in, &insize)) {
-        return -3; /* Z_DATA_ERROR - input data error */
-    }
-    if (infile != stdin) fclose(infile);
-    if (insize > 2147483647) { ret = -3; goto fail1; /* don't support for now */ }
-
-    z_stream stream;
-    stream.zalloc = 0;
-    stream.zfree = 0;
-    stream.opaque = 0;
-
-    ret = deflateInit2(&stream, level, Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY);
-    if (ret != Z_OK) goto fail1;
-
-    if (name_len != 0 || mtime != 0) {
-        gz_header header;
-        memset(&header, 0, sizeof(header));
-        header.time = mtime;
-        header.name = name_len ? (unsigned char*)fname : NULL;
-        header.os = 3; /* UNIX filesystem */
-        ret = deflateSetHeader(&stream, &header);
-        if (ret != Z_OK) goto fail1; /* should not happen */
-    }
-
-    size_t buget = deflateBound(&stream, insize) + name_len + 1;
-    unsigned char* out = (unsigned char*)malloc(buget);
-    if (!out) goto fail1;
-
-    stream.next_in = (z_const unsigned char *)in;
-    stream.avail_in = insize;
-    stream.avail_out = buget;
-    stream.next_out = out;
+static int load_model(const char* path, ZopfliCostModel* model) {
+    unsigned char* data = 0;
+    size_t size = 0;
+    FILE* f = fopen(path, "rb");
+    if (!f) return 0;
+    int ok = ZopfliLoadFile(f, &data, &size) && ZopfliLoadCostModel(model, data, size);
+    fclose(f);
+    free(data);
+    return ok;
+}
 
-    ret = deflate(&stream, Z_FINISH);
-    deflateEnd(&stream);
-    size_t outsize = stream.total_out;
-    if (ret != Z_STREAM_END) goto fail2;
-    ret = 0;
+static unsigned cpu_count(void) {
+#if defined(_WIN32)
+    SYSTEM_INFO info;
+    GetSystemInfo(&info);
+    return info.dwNumberOfProcessors;
+#else
+    long n = sysconf(_SC_NPROCESSORS_ONLN);
+    return n > 0 ? (unsigned)n : 1;
+#endif
+}
 
-    if (!ZopfliSaveFile(outfile, out, outsize)) {
-        ret = -1;
-    }
+static int save_index(const char* outpath, const ZopfliRestartIndex* index) {
+    unsigned char* data = 0;
+    size_t size = 0;
+    char* path = make_outname_with_suffix(outpath, ".idx");
+    if (!path) return 0;
+    FILE* f = fopen(path, "wb");
+    free(path);
+    if (!f) return 0;
+    ZopfliSaveRestartIndex(index, &data, &size);
+    int ok = ZopfliSaveFile(f, data, size);
+    fclose(f);
+    free(data);
+    return ok;
+}
 
-fail2:
-    free(out);
-fail1:
-    free(in);
-    if (outfile != stdout) fclose(outfile);
-    return ret;
+static int save_model(const char* path, const ZopfliCostModel* model) {
+    unsigned char data[ZOPFLI_COSTMODEL_SIZE];
+    FILE* f = fopen(path, "wb");
+    if (!f) return 0;
+    ZopfliSaveCostModel(model, data);
+    int ok = ZopfliSaveFile(f, data, sizeof(data));
+    fclose(f);
+    return ok;
 }
 
 /* Compress/decompress one path (NULL => stdin) to file or stdout */
@@ -536,12 +598,37 @@ static int process_one(const char* inpath) {
     if (g_decompress) {
         ret = ungzlib_extract_to(ctx.strm, outpath);
     } else {
-        unsigned level = g_level;
-        if (level != 1)
-            ret = ZopfliGzip(inpath, outpath, level, ctx.gzip_name, mtime);
-        else {
-            ret = zlib_gz(inpath, outpath, 9, ctx.gzip_name, mtime);
+        ZopfliOptions options;
+        ZopfliInitOptions(&options, g_level, 0);
+        if (g_load_model) options.costmodel_in = &g_model_in;
+        if (g_save_model) options.costmodel_out = &g_model_out;
+        ZopfliRestartIndex index;
+        ZopfliInitRestartIndex(&index);
+        options.membersize = g_member_size;
+        options.bgzf = g_bgzf;
+        options.splitdp = g_split_dp;
+        options.adaptive = g_adaptive;
+        options.convergence = g_converge ? 8 : 0;
+        ZopfliStats stats = {0, 0};
+        if (g_verbose) options.stats = &stats;
+        options.numthreads = g_threads ? g_threads : cpu_count();
+        if (g_restart) {
+            options.restartinterval = g_restart;
+            if (outpath) options.restartindex = &index;
+            else if (!g_quiet) fprintf(stderr, "zopgz: warning: no seek index is written for stdout\n");
         }
+        ret = ZopfliGzip(inpath, outpath, &options, ctx.gzip_name, mtime);
+        if (ret == 0 && g_verbose && stats.iterations) {
+            fprintf(stderr, "zopgz: %s: %zu iterations, %zu skipped after converging\n",
+                    inpath ? inpath : "stdin", stats.iterations, stats.iterationsskipped);
+        }
+        if (ret == 0 && g_save_model && !save_model(g_save_model, &g_model_out)) {
+            fprintf(stderr, "zopgz: cannot write cost model %s\n", g_save_model);
+        }
+        if (ret == 0 && options.restartindex && !save_index(outpath, &index)) {
+            fprintf(stderr, "zopgz: cannot write seek index %s.idx\n", outpath);
+        }
+        ZopfliCleanRestartIndex(&index);
     }
     if (ret == 0 /* Z_OK or 0 */ || (g_decompress && Z_STREAM_END)) {
         if (!g_write_stdout && inpath) {
@@ -584,6 +671,10 @@ fail:
 
 int main(int argc, char** argv) {
     parse_args(argc, argv);
+    if (g_load_model && !g_decompress && !load_model(g_load_model, &g_model_in)) {
+        fprintf(stderr, "zopgz: cannot load cost model %s\n", g_load_model);
+        return 2;
+    }
 
 #if defined(_WIN32)
     if (g_use_stdin) { _setmode(_fileno(stdin),  _O_BINARY); }
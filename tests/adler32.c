@@ -0,0 +1,49 @@
+/*
+Checks ZopfliAdler32 against zlib's adler32 at every CPU level up to the
+detected one, for all short lengths and alignments, long inputs and split
+updates. All-ones data has the largest sums between two reductions.
+*/
+
+#include "testdata.h"
+#include "cpu.h"
+#include "zlib_container.h"
+
+static void CheckAdler32(const unsigned char* data, size_t size) {
+  static const size_t lengths[] = {1000, 4099, 65543, 200000};
+  for (size_t len = 0; len < 300; len++) {
+    for (size_t offset = 0; offset < 16; offset++) {
+      CHECK(ZopfliAdler32(1, data + offset, len) == adler32(1, data + offset, len));
+    }
+  }
+  for (int i = 0; i < 4; i++) {
+    size_t len = lengths[i] < size ? lengths[i] : size;
+    unsigned adler = adler32(1, data + 3, len - 3);
+    CHECK(ZopfliAdler32(1, data + 3, len - 3) == adler);
+    /* Updates must continue where the previous call stopped. */
+    for (size_t split = 1; split < len - 3; split = split * 3 + 1) {
+      CHECK(ZopfliAdler32(ZopfliAdler32(1, data + 3, split), data + 3 + split, len - 3 - split) == adler);
+    }
+  }
+}
+
+int main(void) {
+  size_t size = 200000;
+  unsigned char* random = (unsigned char*)malloc(size);
+  unsigned char* ones = (unsigned char*)malloc(size);
+  int detected;
+  CHECK(random && ones);
+  for (size_t i = 0; i < size; i++) random[i] = NextRandom() & 255;
+  memset(ones, 255, size);
+
+  ZopfliCpuInit();
+  detected = zopfli_cpu;
+  for (int level = detected; level >= ZOPFLI_CPU_GENERIC; level--) {
+    zopfli_cpu = level;
+    CheckAdler32(random, size);
+    CheckAdler32(ones, size);
+  }
+
+  free(random);
+  free(ones);
+  return 0;
+}
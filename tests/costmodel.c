@@ -0,0 +1,74 @@
+/*
+Checks that a cost model survives a save/load round trip bit for bit, that the
+loader rejects damaged data, and that a model learned on one input can start
+the compression of another one.
+*/
+
+#include "testdata.h"
+#include "zopfli.h"
+
+int main(void) {
+  size_t insize = 30000;
+  /* Two halves of the same text, with the same vocabulary. */
+  unsigned char* first = GenerateText(2 * insize, 3);
+  unsigned char* second = first + insize;
+  unsigned char saved[ZOPFLI_COSTMODEL_SIZE];
+  unsigned char resaved[ZOPFLI_COSTMODEL_SIZE];
+  unsigned char damaged[ZOPFLI_COSTMODEL_SIZE];
+  ZopfliCostModel model;
+  ZopfliCostModel loaded;
+  ZopfliOptions options;
+  unsigned char* out = 0;
+  size_t outsize = 0;
+  unsigned char* again = 0;
+  size_t againsize = 0;
+  unsigned symbols = 0;
+
+  ZopfliInitOptions(&options, 4, 0);
+  memset(&model, 0, sizeof(model));
+  options.costmodel_out = &model;
+  ZopfliCompress(&options, ZOPFLI_FORMAT_ZLIB, first, insize, &out, &outsize);
+  CheckInflate(out, outsize, 15, 0, 0, first, insize);
+  free(out);
+  for (int i = 0; i < 288; i++) symbols += model.litlens[i] != 0;
+  CHECK(symbols > 26);
+
+  ZopfliSaveCostModel(&model, saved);
+  CHECK(ZopfliLoadCostModel(&loaded, saved, ZOPFLI_COSTMODEL_SIZE));
+  CHECK(memcmp(&loaded, &model, sizeof(model)) == 0);
+  ZopfliSaveCostModel(&loaded, resaved);
+  CHECK(memcmp(saved, resaved, ZOPFLI_COSTMODEL_SIZE) == 0);
+
+  CHECK(!ZopfliLoadCostModel(&loaded, saved, ZOPFLI_COSTMODEL_SIZE - 1));
+  memcpy(damaged, saved, ZOPFLI_COSTMODEL_SIZE);
+  damaged[0] ^= 1;
+  CHECK(!ZopfliLoadCostModel(&loaded, damaged, ZOPFLI_COSTMODEL_SIZE));
+  /* A NaN cost for the first literal. */
+  memcpy(damaged, saved, ZOPFLI_COSTMODEL_SIZE);
+  memset(damaged + 4 + 4 * (288 + 32), 0xff, 4);
+  CHECK(!ZopfliLoadCostModel(&loaded, damaged, ZOPFLI_COSTMODEL_SIZE));
+  CHECK(ZopfliLoadCostModel(&loaded, saved, ZOPFLI_COSTMODEL_SIZE));
+
+  options.costmodel_out = 0;
+  options.costmodel_in = &loaded;
+  options.reuse_costmodel = 1;
+  out = 0;
+  outsize = 0;
+  ZopfliCompress(&options, ZOPFLI_FORMAT_ZLIB, second, insize, &out, &outsize);
+  CheckInflate(out, outsize, 15, 0, 0, second, insize);
+  /* The model is the only state carried over, so the output repeats. */
+  ZopfliCompress(&options, ZOPFLI_FORMAT_ZLIB, second, insize, &again, &againsize);
+  CHECK(againsize == outsize && memcmp(again, out, outsize) == 0);
+  free(again);
+  /* Without the model the parse starts from the block splitting statistics. */
+  options.costmodel_in = 0;
+  again = 0;
+  againsize = 0;
+  ZopfliCompress(&options, ZOPFLI_FORMAT_ZLIB, second, insize, &again, &againsize);
+  CHECK(againsize != outsize || memcmp(again, out, outsize) != 0);
+  free(again);
+  free(out);
+
+  free(first);
+  return 0;
+}
@@ -0,0 +1,50 @@
+/*
+Checks ZopfliCRC32 against zlib's crc32 at every CPU level up to the detected
+one, for all short lengths and alignments, long inputs and split updates.
+*/
+
+#include "testdata.h"
+#include "cpu.h"
+#include "crc32.h"
+
+static void CheckCRC32(const unsigned char* data, size_t size) {
+  static const size_t lengths[] = {1000, 4099, 65543, 200000};
+  for (size_t len = 0; len < 300; len++) {
+    for (size_t offset = 0; offset < 16; offset++) {
+      CHECK(ZopfliCRC32(0, data + offset, len) == crc32(0, data + offset, len));
+    }
+  }
+  for (int i = 0; i < 4; i++) {
+    size_t len = lengths[i] < size ? lengths[i] : size;
+    unsigned crc = crc32(0, data + 3, len - 3);
+    CHECK(ZopfliCRC32(0, data + 3, len - 3) == crc);
+    /* Updates must continue where the previous call stopped. */
+    for (size_t split = 1; split < len - 3; split = split * 3 + 1) {
+      CHECK(ZopfliCRC32(ZopfliCRC32(0, data + 3, split), data + 3 + split, len - 3 - split) == crc);
+    }
+  }
+}
+
+int main(void) {
+  size_t size = 200000;
+  unsigned char* random = (unsigned char*)malloc(size);
+  unsigned char* ones = (unsigned char*)malloc(size);
+  int detected, clmul;
+  CHECK(random && ones);
+  for (size_t i = 0; i < size; i++) random[i] = NextRandom() & 255;
+  memset(ones, 255, size);
+
+  ZopfliCpuInit();
+  detected = zopfli_cpu;
+  clmul = zopfli_cpu_clmul;
+  for (int level = detected; level >= ZOPFLI_CPU_GENERIC; level--) {
+    zopfli_cpu = level;
+    zopfli_cpu_clmul = clmul && level >= ZOPFLI_CPU_SSE4_2;
+    CheckCRC32(random, size);
+    CheckCRC32(ones, size);
+  }
+
+  free(random);
+  free(ones);
+  return 0;
+}
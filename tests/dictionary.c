@@ -0,0 +1,64 @@
+/*
+Checks preset dictionary output against zlib: the FDICT flag and DICTID of the
+zlib header, and that zlib decodes both the zlib and the raw deflate stream
+given the same dictionary.
+*/
+
+#include "testdata.h"
+#include "deflate.h"
+#include "zlib_container.h"
+#include "zopfli.h"
+
+int main(void) {
+  static const unsigned levels[] = {1, 2, 5};
+  /* Longer than the window, so only its tail can be referenced. */
+  size_t dictsize = 40000;
+  size_t insize = 20000;
+  unsigned char* dict = GenerateText(dictsize, 7);
+  unsigned char* in = GenerateText(insize, 7);
+
+  for (int l = 0; l < 3; l++) {
+    ZopfliOptions options;
+    unsigned char* out = 0;
+    size_t outsize = 0;
+    unsigned char* plain = 0;
+    size_t plainsize = 0;
+    unsigned dictid;
+    ZopfliInitOptions(&options, levels[l], 0);
+
+    ZopfliZlibCompressDict(&options, dict, dictsize, in, insize, &out, &outsize);
+    CHECK(outsize > 6);
+    CHECK(((out[0] << 8) | out[1]) % 31 == 0);
+    CHECK(out[1] & 0x20);
+    dictid = ((unsigned)out[2] << 24) | (out[3] << 16) | (out[4] << 8) | out[5];
+    CHECK(dictid == adler32(1, dict, dictsize));
+    CheckInflate(out, outsize, 15, dict, dictsize, in, insize);
+
+    /* Same vocabulary, so the dictionary must help. */
+    ZopfliZlibCompress(&options, in, insize, &plain, &plainsize);
+    CHECK(outsize < plainsize);
+    CheckInflate(plain, plainsize, 15, 0, 0, in, insize);
+
+    /* An empty dictionary writes a plain zlib stream. */
+    free(out);
+    out = 0;
+    outsize = 0;
+    ZopfliZlibCompressDict(&options, dict, 0, in, insize, &out, &outsize);
+    CHECK(outsize == plainsize && memcmp(out, plain, plainsize) == 0);
+    free(out);
+    free(plain);
+
+    out = 0;
+    outsize = 0;
+    {
+      unsigned char bp = 0;
+      ZopfliDeflateDict(&options, 1, dict, dictsize, in, insize, &bp, &out, &outsize);
+    }
+    CheckInflate(out, outsize, -15, dict, dictsize, in, insize);
+    free(out);
+  }
+
+  free(dict);
+  free(in);
+  return 0;
+}
@@ -0,0 +1,59 @@
+/*
+Checks ZopfliEstimateSize against the bounds documented in zopfli.h: every tier
+must come out at or above the raw deflate size of level 4 and at most the
+documented amount above it, on text, random bytes, long runs and a mix.
+*/
+
+#include "testdata.h"
+#include "zopfli.h"
+
+/* Documented upper bounds in percent, by tier. */
+static const double bounds[3] = {28, 21, 9};
+
+static void CheckEstimates(const char* name, const unsigned char* in, size_t insize) {
+  ZopfliOptions options;
+  unsigned char* out = 0;
+  size_t outsize = 0;
+  ZopfliInitOptions(&options, 4, 0);
+  ZopfliCompress(&options, ZOPFLI_FORMAT_DEFLATE, in, insize, &out, &outsize);
+  free(out);
+  for (int tier = ZOPFLI_ESTIMATE_SAMPLED; tier <= ZOPFLI_ESTIMATE_OPTIMAL; tier++) {
+    size_t estimate = ZopfliEstimateSize(&options, (ZopfliEstimateTier)tier, in, insize);
+    double bound = outsize * (1 + bounds[tier] / 100);
+    /* The sampled tier costs every 64 KB window as a block of its own. */
+    if (tier == ZOPFLI_ESTIMATE_SAMPLED) bound += 40 * (insize / 65536 + 1);
+    if (estimate < outsize || estimate > bound) {
+      fprintf(stderr, "%s: estimate %lu of tier %d, level 4 writes %lu\n", name,
+              (unsigned long)estimate, tier, (unsigned long)outsize);
+      exit(1);
+    }
+  }
+}
+
+int main(void) {
+  size_t insize = 300000;
+  unsigned char* text = GenerateText(insize, 11);
+  unsigned char* random = (unsigned char*)malloc(insize);
+  unsigned char* runs = (unsigned char*)malloc(insize);
+  unsigned char* mix = GenerateText(insize, 13);
+  CHECK(random && runs);
+  for (size_t i = 0; i < insize; i++) random[i] = NextRandom() & 255;
+  for (size_t i = 0; i < insize; i++) runs[i] = "abc"[i / 5000 % 3];
+  /* Text with incompressible stretches and runs in between. */
+  for (size_t i = 0; i < insize; i += 50000) {
+    memcpy(mix + i, random + i, 10000);
+    memset(mix + i + 10000, 0, 5000);
+  }
+
+  CheckEstimates("text", text, insize);
+  CheckEstimates("random", random, insize);
+  CheckEstimates("runs", runs, insize);
+  CheckEstimates("mix", mix, insize);
+  CheckEstimates("empty", text, 0);
+
+  free(text);
+  free(random);
+  free(runs);
+  free(mix);
+  return 0;
+}
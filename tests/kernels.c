@@ -0,0 +1,54 @@
+/*
+Output must not depend on the CPU level: compresses the same data with the
+cost relaxation kernels of every level up to the detected one and fails unless
+all outputs are identical and decode. NEON builds have a single kernel, so
+there it only checks that the output decodes.
+*/
+
+#include "testdata.h"
+#include "cpu.h"
+#include "zopfli.h"
+
+int main(void) {
+  /* Float costs, 16-bit fixed-point costs, and the integer costs of ultra2. */
+  static const unsigned levels[] = {2, 5, 6};
+  static const unsigned ultras[] = {0, 0, 3};
+  /* Large enough for an ultra2 pass to win at least once. */
+  size_t insize = 80000;
+  unsigned char* in = GenerateText(insize, 9);
+  int detected;
+  /* A stretch of random bytes, so that there are long literal runs. */
+  for (size_t i = 40000; i < 48000; i++) in[i] = NextRandom() & 255;
+
+  ZopfliCpuInit();
+  detected = zopfli_cpu;
+  for (int l = 0; l < 3; l++) {
+    ZopfliOptions options;
+    unsigned char* first = 0;
+    size_t firstsize = 0;
+    ZopfliInitOptions(&options, levels[l], 0);
+    if (ultras[l]) options.ultra = ultras[l];
+    for (int level = detected; level >= ZOPFLI_CPU_GENERIC; level--) {
+      unsigned char* out = 0;
+      size_t outsize = 0;
+      zopfli_cpu = level;
+      ZopfliCompress(&options, ZOPFLI_FORMAT_DEFLATE, in, insize, &out, &outsize);
+      if (!first) {
+        CheckInflate(out, outsize, -15, 0, 0, in, insize);
+        first = out;
+        firstsize = outsize;
+        continue;
+      }
+      if (outsize != firstsize || memcmp(out, first, outsize)) {
+        fprintf(stderr, "level %u: output at cpu level %d differs from level %d\n", levels[l], level, detected);
+        return 1;
+      }
+      free(out);
+    }
+    free(first);
+  }
+  zopfli_cpu = detected;
+
+  free(in);
+  return 0;
+}
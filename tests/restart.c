@@ -0,0 +1,93 @@
+/*
+Checks restart points: zlib must decode the raw deflate data from every point
+on its own and get the input from the point's offset on, and the sidecar must
+decode back to the same points.
+*/
+
+#include "testdata.h"
+#include "zopfli.h"
+
+static size_t ReadLEB128(const unsigned char* in, size_t insize, size_t* pos) {
+  size_t value = 0;
+  unsigned shift = 0;
+  for (;;) {
+    CHECK(*pos < insize && shift < 64);
+    value |= (size_t)(in[*pos] & 127) << shift;
+    shift += 7;
+    if (!(in[(*pos)++] & 128)) return value;
+  }
+}
+
+static void CheckSidecar(const ZopfliRestartIndex* index) {
+  unsigned char* sidecar = 0;
+  size_t sidecarsize = 0;
+  size_t pos = 4;
+  ZopfliRestartPoint last = {0, 0};
+  ZopfliSaveRestartIndex(index, &sidecar, &sidecarsize);
+  CHECK(sidecarsize > 4 && memcmp(sidecar, "ZRI\1", 4) == 0);
+  CHECK(ReadLEB128(sidecar, sidecarsize, &pos) == index->size);
+  for (size_t i = 0; i < index->size; i++) {
+    last.in += ReadLEB128(sidecar, sidecarsize, &pos);
+    last.out += ReadLEB128(sidecar, sidecarsize, &pos);
+    CHECK(last.in == index->points[i].in && last.out == index->points[i].out);
+  }
+  CHECK(pos == sidecarsize);
+  free(sidecar);
+}
+
+/*
+Compresses in as gzip and checks that decoding from every restart point gives
+the data up to the next one, or to the end if the points share one member.
+*/
+static void CheckRestartPoints(const ZopfliOptions* options, const unsigned char* in,
+                               size_t insize, int members, size_t expected) {
+  ZopfliRestartIndex index;
+  ZopfliOptions restartoptions = *options;
+  unsigned char* out = 0;
+  size_t outsize = 0;
+  ZopfliInitRestartIndex(&index);
+  restartoptions.restartindex = &index;
+  ZopfliCompress(&restartoptions, ZOPFLI_FORMAT_GZIP, in, insize, &out, &outsize);
+  CheckInflate(out, outsize, 31, 0, 0, in, insize);
+
+  CHECK(index.size == expected);
+  CHECK(index.points[0].in == 0 && index.points[0].out == 10);
+  for (size_t i = 0; i < index.size; i++) {
+    size_t start = index.points[i].in;
+    size_t end = insize;
+    if (i + 1 < index.size) {
+      CHECK(index.points[i + 1].in > start && index.points[i + 1].out > index.points[i].out);
+      if (members) end = index.points[i + 1].in;
+    }
+    CheckInflate(out + index.points[i].out, outsize - index.points[i].out, -15, 0, 0,
+                 in + start, end - start);
+  }
+  CheckSidecar(&index);
+  ZopfliCleanRestartIndex(&index);
+  free(out);
+}
+
+int main(void) {
+  /* Level 2 uses 1 MB master blocks, so this makes 3 of them. */
+  size_t insize = 2100000;
+  unsigned char* in = GenerateText(insize, 5);
+  ZopfliOptions options;
+  ZopfliRestartIndex empty;
+
+  ZopfliInitOptions(&options, 2, 0);
+  options.restartinterval = 1;
+  CheckRestartPoints(&options, in, insize, 0, 3);
+  options.restartinterval = 2;
+  CheckRestartPoints(&options, in, 1500000, 0, 1);
+
+  /* Every gzip member starts at a restart point. */
+  ZopfliInitOptions(&options, 1, 0);
+  options.membersize = 65536;
+  CheckRestartPoints(&options, in, 300000, 1, 5);
+
+  ZopfliInitRestartIndex(&empty);
+  CheckSidecar(&empty);
+
+  free(in);
+  return 0;
+}
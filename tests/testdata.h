@@ -0,0 +1,95 @@
+/*
+Helpers shared by the library tests: generated input and a zlib based
+decoder to check the output against.
+*/
+
+#ifndef ZOPFLI_TESTDATA_H_
+#define ZOPFLI_TESTDATA_H_
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <zlib.h>
+
+#define CHECK(cond) do { \
+  if (!(cond)) { \
+    fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #cond); \
+    exit(1); \
+  } \
+} while (0)
+
+static unsigned test_random = 1;
+
+static unsigned NextRandom(void) {
+  test_random = (test_random * 1103515245u + 12345u) & 0x7fffffff;
+  return test_random >> 8;
+}
+
+/*
+Fills a new array with size bytes of text made of 64 random words, like
+threads.cmake does, so it compresses to roughly a third. Different seeds give
+different vocabularies.
+*/
+static unsigned char* GenerateText(size_t size, unsigned seed) {
+  char words[64][9];
+  unsigned char* data = (unsigned char*)malloc(size);
+  size_t i = 0;
+  CHECK(data);
+  test_random = seed;
+  for (int w = 0; w < 64; w++) {
+    unsigned n = 2 + NextRandom() % 7;
+    for (unsigned k = 0; k < n; k++) words[w][k] = 'a' + NextRandom() % 26;
+    words[w][n] = 0;
+  }
+  while (i < size) {
+    unsigned r = NextRandom();
+    const char* word = words[r % 64];
+    while (*word && i < size) data[i++] = *word++;
+    if (i < size) data[i++] = r % 8 ? ' ' : '\n';
+  }
+  return data;
+}
+
+/*
+Inflates in[0, insize) and fails unless it decodes to exactly expected.
+windowbits as for inflateInit2: -15 for raw deflate, 15 for zlib, 31 for gzip.
+dict is set when the stream asks for it, or up front for raw deflate. Raw
+deflate may be followed by other data, gzip may have several members.
+*/
+static void CheckInflate(const unsigned char* in, size_t insize, int windowbits,
+                         const unsigned char* dict, size_t dictsize,
+                         const unsigned char* expected, size_t expectedsize) {
+  z_stream s;
+  unsigned char* out = (unsigned char*)malloc(expectedsize + 1);
+  int ret;
+  CHECK(out);
+  memset(&s, 0, sizeof(s));
+  CHECK(inflateInit2(&s, windowbits) == Z_OK);
+  if (windowbits < 0 && dictsize) {
+    CHECK(inflateSetDictionary(&s, dict, dictsize) == Z_OK);
+  }
+  s.next_in = (unsigned char*)in;
+  s.avail_in = insize;
+  s.next_out = out;
+  s.avail_out = expectedsize + 1;
+  ret = inflate(&s, Z_FINISH);
+  if (ret == Z_NEED_DICT) {
+    CHECK(dictsize);
+    CHECK(inflateSetDictionary(&s, dict, dictsize) == Z_OK);
+    ret = inflate(&s, Z_FINISH);
+  }
+  /* gzip members follow each other, as gzip -d decodes them. */
+  while (ret == Z_STREAM_END && windowbits > 15 && s.avail_in) {
+    uLong total = s.total_out;
+    CHECK(inflateReset(&s) == Z_OK);
+    s.total_out = total;
+    ret = inflate(&s, Z_FINISH);
+  }
+  CHECK(ret == Z_STREAM_END);
+  CHECK(s.total_out == expectedsize);
+  CHECK(memcmp(out, expected, expectedsize) == 0);
+  inflateEnd(&s);
+  free(out);
+}
+
+#endif  /* ZOPFLI_TESTDATA_H_ */
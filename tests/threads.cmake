@@ -0,0 +1,67 @@
+# Compresses generated data into many gzip members with 1, 2 and 4 threads and
+# fails unless all outputs are identical. Each member starts with a short run
+# of digits, which becomes a small fixed-tree block in front of a dynamic one.
+# Usage: cmake -DZOPGZ=<zopgz> -DWORK_DIR=<dir> -P threads.cmake
+
+set(x 1)
+macro(next_random)
+  math(EXPR x "(${x} * 1103515245 + 12345) % 2147483648")
+  math(EXPR r "${x} >> 8")
+endmacro()
+
+set(letters "abcdefghijklmnopqrstuvwxyz")
+set(words "")
+foreach(w RANGE 63)
+  next_random()
+  math(EXPR n "2 + ${r} % 7")
+  set(word "")
+  foreach(k RANGE 1 ${n})
+    next_random()
+    math(EXPR c "${r} % 26")
+    string(SUBSTRING "${letters}" ${c} 1 l)
+    string(APPEND word "${l}")
+  endforeach()
+  list(APPEND words "${word}")
+endforeach()
+
+set(data "")
+foreach(m RANGE 7)
+  set(member "")
+  foreach(k RANGE 99)
+    next_random()
+    math(EXPR c "${r} % 10")
+    string(APPEND member "${c}")
+  endforeach()
+  string(LENGTH "${member}" len)
+  while(len LESS 16384)
+    next_random()
+    math(EXPR c "${r} % 64")
+    list(GET words ${c} word)
+    math(EXPR c "${r} % 8")
+    if(c)
+      string(APPEND member "${word} ")
+    else()
+      string(APPEND member "${word}\n")
+    endif()
+    string(LENGTH "${member}" len)
+  endwhile()
+  string(SUBSTRING "${member}" 0 16384 member)
+  string(APPEND data "${member}")
+endforeach()
+file(WRITE "${WORK_DIR}/threads.in" "${data}")
+
+foreach(threads 1 2 4)
+  execute_process(COMMAND "${ZOPGZ}" -c -3 --members=16k --threads=${threads} "${WORK_DIR}/threads.in"
+                  OUTPUT_FILE "${WORK_DIR}/threads.${threads}.gz"
+                  RESULT_VARIABLE result)
+  if(result)
+    message(FATAL_ERROR "zopgz --threads=${threads} failed: ${result}")
+  endif()
+endforeach()
+foreach(threads 2 4)
+  execute_process(COMMAND ${CMAKE_COMMAND} -E compare_files "${WORK_DIR}/threads.1.gz" "${WORK_DIR}/threads.${threads}.gz"
+                  RESULT_VARIABLE result)
+  if(result)
+    message(FATAL_ERROR "output with --threads=${threads} differs from --threads=1")
+  endif()
+endforeach()